@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alias.h"
+#include "strmap.h"
+
+struct alias {
+  char *text;
+  /* The text's words, ready to be spliced in */
+  struct tokens *tokens;
+  /* A small number of its own, for the set of aliases being expanded */
+  size_t id;
+};
+
+static struct strmap *aliases;
+
+/* The ids of removed aliases, handed out again so that the ids stay dense */
+static size_t *free_ids;
+static size_t free_ids_length;
+static size_t ids_length;
+
+static void alias_free(void *data) {
+  struct alias *alias = (struct alias *) data;
+  free_ids = (size_t *) realloc(free_ids, sizeof(size_t) * (free_ids_length + 1));
+  free_ids[free_ids_length++] = alias->id;
+  free(alias->text);
+  tokens_destroy(alias->tokens);
+  free(alias);
+}
+
+static void alias_define(const char *name, const char *text) {
+  if (aliases == NULL)
+    aliases = strmap_new();
+  void **slot = strmap_put(aliases, name);
+  struct alias *alias = (struct alias *) *slot;
+  if (alias == NULL) {
+    alias = (struct alias *) calloc(1, sizeof(struct alias));
+    alias->id = free_ids_length > 0 ? free_ids[--free_ids_length] : ids_length++;
+    *slot = alias;
+  } else {
+    free(alias->text);
+    tokens_destroy(alias->tokens);
+  }
+  alias->text = strdup(text);
+  alias->tokens = tokenize(text);
+}
+
+/* Names can't hold anything the tokenizer would split or quote */
+static bool alias_name_valid(const char *name, size_t length) {
+  if (length == 0)
+    return false;
+  for (size_t i = 0; i < length; i++)
+    if (strchr(" \t\n'\"\\$`/=;&|<>()", name[i]) != NULL || name[i] == TOKEN_EXPAND)
+      return false;
+  return true;
+}
+
+/* The alias that the Nth word names, if it does */
+static struct alias *alias_find(struct tokens *tokens, size_t n) {
+  if (tokens_is_operator(tokens, n))
+    return NULL;
+  void **slot = strmap_get(aliases, tokens_get_token(tokens, n));
+  return slot ? (struct alias *) *slot : NULL;
+}
+
+/* Is the word after the Nth one the first of a command? */
+static bool starts_command(struct tokens *tokens, size_t n) {
+  return tokens_match(tokens, n, ";") || tokens_match(tokens, n, "&") ||
+      tokens_match(tokens, n, "&&") || tokens_match(tokens, n, "||") ||
+      tokens_match(tokens, n, "|") || tokens_match(tokens, n, "(");
+}
+
+#define BIT_TEST(set, n) ((set)[(n) / 64] & (UINT64_C(1) << (n) % 64))
+#define BIT_FLIP(set, n) ((set)[(n) / 64] ^= UINT64_C(1) << (n) % 64)
+
+/* Copies the words to out, expanding the aliases in command position that aren't already
+ * being expanded (those in being). Returns whether the word after these starts a command. */
+static bool expand_into(struct tokens *out, struct tokens *tokens, uint64_t *being,
+    bool command) {
+  for (size_t i = 0; i < tokens_get_length(tokens); i++) {
+    struct alias *alias = command ? alias_find(tokens, i) : NULL;
+    if (alias == NULL || BIT_TEST(being, alias->id)) {
+      tokens_append(out, tokens_get_token(tokens, i), tokens_is_operator(tokens, i));
+      command = starts_command(tokens, i);
+      continue;
+    }
+    BIT_FLIP(being, alias->id);
+    command = expand_into(out, alias->tokens, being, true);
+    BIT_FLIP(being, alias->id);
+    /* As in sh, an alias that ends in a blank lets the next word be an alias too */
+    size_t length = strlen(alias->text);
+    if (length > 0 && (alias->text[length - 1] == ' ' || alias->text[length - 1] == '\t'))
+      command = true;
+  }
+  return command;
+}
+
+struct tokens *alias_expand(struct tokens *tokens) {
+  if (aliases == NULL || strmap_length(aliases) == 0)
+    return NULL;
+
+  /* Most lines name no alias; find that out before copying anything */
+  bool command = true, found = false;
+  for (size_t i = 0; i < tokens_get_length(tokens) && !found; i++) {
+    found = command && alias_find(tokens, i) != NULL;
+    command = starts_command(tokens, i);
+  }
+  if (!found)
+    return NULL;
+
+  uint64_t being[ids_length / 64 + 1];
+  memset(being, 0, sizeof(being));
+  struct tokens *expanded = tokens_new();
+  expand_into(expanded, tokens, being, true);
+  return expanded;
+}
+
+void alias_save(struct snapshot *snapshot) {
+  const char *name;
+  void *value;
+  for (size_t cursor = 0; aliases && strmap_next(aliases, &cursor, &name, &value);) {
+    snapshot_put_string(snapshot, name);
+    snapshot_put_string(snapshot, ((struct alias *) value)->text);
+  }
+}
+
+int alias_load(struct snapshot_reader *reader) {
+  const char *name;
+  while ((name = snapshot_get_string(reader)) != NULL) {
+    const char *text = snapshot_get_string(reader);
+    if (text == NULL || !alias_name_valid(name, strlen(name)))
+      return -1;
+    alias_define(name, text);
+  }
+  return 0;
+}
+
+static void alias_print(const char *name, const struct alias *alias) {
+  printf("alias %s=\"", name);
+  for (const char *p = alias->text; *p != '\0'; p++) {
+    if (*p == '"' || *p == '\\' || *p == '$')
+      putchar('\\');
+    putchar(*p);
+  }
+  printf("\"\n");
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+
+int cmd_alias(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  if (length == 1) {
+    /* Everything, sorted by name */
+    size_t count = aliases ? strmap_length(aliases) : 0, n = 0;
+    const char *names[count + 1];
+    void *value;
+    for (size_t cursor = 0; aliases && strmap_next(aliases, &cursor, &names[n], &value);)
+      n++;
+    qsort(names, n, sizeof(const char *), compare_names);
+    for (size_t i = 0; i < n; i++)
+      alias_print(names[i], (struct alias *) *strmap_get(aliases, names[i]));
+    return 0;
+  }
+
+  int status = 0;
+  for (size_t i = 1; i < length; i++) {
+    char *word = tokens_get_token(tokens, i);
+    char *equals = strchr(word, '=');
+    size_t name_length = equals ? (size_t) (equals - word) : strlen(word);
+    if (!alias_name_valid(word, name_length)) {
+      fprintf(stderr, "alias: %s: invalid alias name\n", word);
+      status = 1;
+    } else if (equals != NULL) {
+      char *name = strndup(word, name_length);
+      alias_define(name, equals + 1);
+      free(name);
+    } else {
+      void **slot = aliases ? strmap_get(aliases, word) : NULL;
+      if (slot != NULL) {
+        alias_print(word, (struct alias *) *slot);
+      } else {
+        fprintf(stderr, "alias: %s: not found\n", word);
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
+
+int cmd_unalias(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  if (length == 2 && strcmp(tokens_get_token(tokens, 1), "-a") == 0) {
+    if (aliases != NULL)
+      strmap_destroy(aliases, alias_free);
+    aliases = NULL;
+    return 0;
+  }
+  if (length == 1) {
+    fprintf(stderr, "usage: unalias -a | NAME...\n");
+    return 2;
+  }
+
+  int status = 0;
+  for (size_t i = 1; i < length; i++) {
+    char *name = tokens_get_token(tokens, i);
+    struct alias *alias = aliases ? (struct alias *) strmap_remove(aliases, name) : NULL;
+    if (alias != NULL) {
+      alias_free(alias);
+    } else {
+      fprintf(stderr, "unalias: %s: not found\n", name);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "snapshot.h"
+#include "tokenizer.h"
+
+/* Aliases live in a hash table, and each is tokenized once when it is defined; expanding one
+ * splices in copies of its words. */
+
+/* Replaces every word in command position (the first of the line, or the first after `;', `&',
+ * `&&', `||', `|' or `(') that names an alias with the alias's words. An alias isn't expanded
+ * again inside its own expansion. Returns the new words, or NULL if nothing was expanded. */
+struct tokens *alias_expand(struct tokens *tokens);
+
+/* Adds the aliases to a snapshot section, and loads them back */
+void alias_save(struct snapshot *snapshot);
+int alias_load(struct snapshot_reader *reader);
+
+/* Built-in: `alias [NAME[=VALUE]]...' defines aliases or prints them */
+int cmd_alias(struct tokens *tokens);
+
+/* Built-in: `unalias -a | NAME...' removes aliases */
+int cmd_unalias(struct tokens *tokens);
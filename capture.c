@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "job.h"
+#include "parse.h"
+
+#define MAX_DESTINATIONS 16
+#define CHUNK (64 * 1024)
+
+/* A named in-memory copy of a command's output. A ring buffer keeps only the last capacity
+ * bytes, starting at start. */
+struct capture {
+  struct capture *next;
+  char *name;
+  char *data;
+  size_t length;
+  size_t capacity;
+  size_t start;
+  bool ring;
+};
+
+static struct capture *captures;
+
+/* Somewhere the output goes: a file descriptor or a capture */
+struct destination {
+  int fd;
+  struct capture *capture;
+};
+
+static struct capture *capture_find(const char *name) {
+  for (struct capture *capture = captures; capture != NULL; capture = capture->next)
+    if (strcmp(capture->name, name) == 0)
+      return capture;
+  return NULL;
+}
+
+static void capture_drop(const char *name) {
+  for (struct capture **link = &captures; *link != NULL; link = &(*link)->next) {
+    if (strcmp((*link)->name, name) == 0) {
+      struct capture *capture = *link;
+      *link = capture->next;
+      free(capture->name);
+      free(capture->data);
+      free(capture);
+      return;
+    }
+  }
+}
+
+/* Makes a fresh, empty capture, replacing any with the same name. Returns NULL if there is no
+ * memory for the ring. */
+static struct capture *capture_new(const char *name, size_t ring_size) {
+  char *data = ring_size > 0 ? (char *) malloc(ring_size) : NULL;
+  if (ring_size > 0 && data == NULL)
+    return NULL;
+  capture_drop(name);
+  struct capture *capture = (struct capture *) calloc(1, sizeof(struct capture));
+  capture->name = strdup(name);
+  capture->ring = ring_size > 0;
+  capture->capacity = ring_size;
+  capture->data = data;
+  capture->next = captures;
+  captures = capture;
+  return capture;
+}
+
+static void capture_append(struct capture *capture, const char *data, size_t n) {
+  if (!capture->ring) {
+    if (capture->length + n > capture->capacity) {
+      capture->capacity = (capture->length + n) * 2;
+      capture->data = (char *) realloc(capture->data, capture->capacity);
+    }
+    memcpy(capture->data + capture->length, data, n);
+    capture->length += n;
+    return;
+  }
+  /* Only the last capacity bytes of the chunk can survive */
+  if (n > capture->capacity) {
+    data += n - capture->capacity;
+    n = capture->capacity;
+  }
+  for (size_t i = 0; i < n; i++) {
+    size_t end = (capture->start + capture->length) % capture->capacity;
+    capture->data[end] = data[i];
+    if (capture->length < capture->capacity)
+      capture->length++;
+    else
+      capture->start = (capture->start + 1) % capture->capacity;
+  }
+}
+
+static void capture_print(struct capture *capture) {
+  size_t first = capture->length;
+  if (capture->ring && capture->start + capture->length > capture->capacity)
+    first = capture->capacity - capture->start;
+  fwrite(capture->data + capture->start, 1, first, stdout);
+  fwrite(capture->data, 1, capture->length - first, stdout);
+}
+
+static int write_all(int fd, const char *data, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, data, n);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return -1;
+    data += written;
+    n -= written;
+  }
+  return 0;
+}
+
+/* Hands data in memory to a destination */
+static int deliver(struct destination *destination, const char *data, size_t n) {
+  if (destination->capture == NULL)
+    return write_all(destination->fd, data, n);
+  capture_append(destination->capture, data, n);
+  return 0;
+}
+
+/* Moves exactly n bytes out of the pipe src into a destination: spliced into a file
+ * descriptor where the kernel allows it, read into memory for captures. If the destination
+ * fails, the rest of the n bytes are still taken out of src, so the pipe stays in step. */
+static int drain(int src, size_t n, struct destination *destination) {
+  char buf[CHUNK];
+  int result = 0;
+  while (n > 0) {
+    if (destination->capture == NULL && result == 0) {
+      ssize_t moved = splice(src, NULL, destination->fd, NULL, n, SPLICE_F_MOVE);
+      if (moved > 0) {
+        n -= moved;
+        continue;
+      }
+      if (moved < 0 && errno == EINTR)
+        continue;
+      if (moved < 0 && errno != EINVAL)
+        result = -1;
+    }
+    /* Captures, and descriptors splice() can't write to (such as O_APPEND files) */
+    ssize_t got = read(src, buf, n < sizeof(buf) ? n : sizeof(buf));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    if (result == 0 && deliver(destination, buf, got) < 0)
+      result = -1;
+    n -= got;
+  }
+  return result;
+}
+
+static void destination_failed(bool *failed) {
+  if (!*failed)
+    perror("capture");
+  *failed = true;
+}
+
+/* Copies everything from the pipe src to every destination until end of file, or until the
+ * job writing it stops (it is left stopped, and what it writes once continued is lost). Every
+ * destination but the last gets a tee()'d copy by way of the spare pipe; the last one takes
+ * the original data. Nothing passes through user space unless it has to: should a tee() come
+ * up short, the chunk is read once and the destinations that missed part of it get the rest
+ * from memory. */
+static void pump(int src, struct destination *destinations, size_t length, struct job *job) {
+  int spare[2] = {-1, -1};
+  if (length > 1 && pipe2(spare, O_CLOEXEC) < 0) {
+    perror("capture: pipe");
+    return;
+  }
+  fcntl(src, F_SETPIPE_SZ, CHUNK);
+  fcntl(spare[0], F_SETPIPE_SZ, CHUNK);
+
+  struct destination *last = &destinations[length - 1];
+  bool failed[MAX_DESTINATIONS] = {false};
+  bool spliceable = length == 1 && last->capture == NULL;
+  char buf[CHUNK];
+  for (;;) {
+    ssize_t n;
+    if (job_poll_fd(job, src, POLLIN) == 0)
+      break;
+    if (spliceable && !failed[0]) {
+      /* A single descriptor; splice() blocks until there is something to move */
+      n = splice(src, NULL, last->fd, NULL, CHUNK, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n > 0)
+        continue;
+      if (n == 0)
+        break;
+      /* Otherwise it has to go through memory, below */
+      if (errno == EINVAL)
+        spliceable = false;
+      else
+        destination_failed(&failed[0]);
+    }
+    if (length == 1) {
+      n = read(src, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      if (!failed[0] && deliver(last, buf, n) < 0)
+        destination_failed(&failed[0]);
+      continue;
+    }
+
+    n = tee(src, spare[1], CHUNK, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    /* How much of the chunk each destination has had */
+    size_t given[MAX_DESTINATIONS];
+    bool short_tee = false;
+    for (size_t i = 0; i + 1 < length; i++) {
+      ssize_t copied = i == 0 ? n : 0;
+      if (failed[i] && i > 0) {
+        given[i] = n;
+        continue;
+      }
+      while (i > 0 && (copied = tee(src, spare[1], n, 0)) < 0 && errno == EINTR)
+        ;
+      given[i] = copied > 0 ? copied : 0;
+      short_tee |= given[i] < (size_t) n;
+      if (given[i] > 0 && drain(spare[0], given[i], &destinations[i]) < 0)
+        destination_failed(&failed[i]);
+    }
+    if (!short_tee) {
+      if (drain(src, n, last) < 0)
+        destination_failed(&failed[length - 1]);
+      continue;
+    }
+    size_t got = 0;
+    while (got < (size_t) n) {
+      ssize_t r = read(src, buf + got, n - got);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      got += r;
+    }
+    for (size_t i = 0; i + 1 < length; i++)
+      if (given[i] < got && !failed[i] && deliver(&destinations[i], buf + given[i],
+          got - given[i]) < 0)
+        destination_failed(&failed[i]);
+    if (!failed[length - 1] && deliver(last, buf, got) < 0)
+      destination_failed(&failed[length - 1]);
+  }
+  if (spare[0] >= 0) {
+    close(spare[0]);
+    close(spare[1]);
+  }
+}
+
+/* Is no earlier destination of the command already filling the capture called name? Naming
+ * one twice would drop it while it is still in use. */
+static bool name_unused(struct destination *destinations, size_t length, const char *name) {
+  for (size_t i = 0; i < length; i++)
+    if (destinations[i].capture != NULL && strcmp(destinations[i].capture->name, name) == 0)
+      return false;
+  return true;
+}
+
+static int usage(void) {
+  fprintf(stderr, "usage: capture [-q] [-o FILE] [-a FILE] [-m NAME] [-r NAME:SIZE]... "
+      "COMMAND...\n       capture -p NAME | -d NAME\n");
+  return 2;
+}
+
+int cmd_capture(struct tokens *tokens) {
+  struct destination destinations[MAX_DESTINATIONS];
+  size_t length = 0;
+  bool quiet = false;
+  int status = 0;
+
+  char *option = tokens_get_token(tokens, 1), *value = tokens_get_token(tokens, 2);
+  if (option != NULL && value != NULL && strcmp(option, "-p") == 0) {
+    struct capture *capture = capture_find(value);
+    if (capture == NULL) {
+      fprintf(stderr, "capture: %s: no such capture\n", value);
+      return 1;
+    }
+    capture_print(capture);
+    return 0;
+  } else if (option != NULL && value != NULL && strcmp(option, "-d") == 0) {
+    capture_drop(value);
+    return 0;
+  }
+
+  size_t i = 1;
+  for (; i < tokens_get_length(tokens); i++) {
+    option = tokens_get_token(tokens, i);
+    value = tokens_get_token(tokens, i + 1);
+    if (strcmp(option, "-q") == 0) {
+      quiet = true;
+      continue;
+    }
+    if (option[0] != '-' || value == NULL)
+      break;
+    if (length + 1 == MAX_DESTINATIONS) {
+      fprintf(stderr, "capture: too many destinations\n");
+      status = 2;
+      goto done;
+    }
+
+    struct destination *destination = &destinations[length];
+    destination->fd = -1;
+    destination->capture = NULL;
+    if (strcmp(option, "-o") == 0 || strcmp(option, "-a") == 0) {
+      int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (option[1] == 'a' ? O_APPEND : O_TRUNC);
+      if ((destination->fd = open(value, flags, 0666)) < 0) {
+        fprintf(stderr, "capture: %s: %s\n", value, strerror(errno));
+        status = 1;
+        goto done;
+      }
+    } else if (strcmp(option, "-m") == 0) {
+      if (!name_unused(destinations, length, value)) {
+        fprintf(stderr, "capture: %s: named twice\n", value);
+        status = 2;
+        goto done;
+      }
+      destination->capture = capture_new(value, 0);
+    } else if (strcmp(option, "-r") == 0) {
+      char *colon = strrchr(value, ':');
+      long long size = colon ? parse_size(colon + 1) : -1;
+      if (size <= 0) {
+        fprintf(stderr, "capture: expected NAME:SIZE: %s\n", value);
+        status = 2;
+        goto done;
+      }
+      *colon = '\0';
+      if (!name_unused(destinations, length, value))
+        fprintf(stderr, "capture: %s: named twice\n", value), status = 2;
+      else if ((destination->capture = capture_new(value, size)) == NULL)
+        fprintf(stderr, "capture: %s: %s\n", value, strerror(ENOMEM)), status = 1;
+      *colon = ':';
+      if (status != 0)
+        goto done;
+    } else {
+      break;
+    }
+    length++;
+    i++;
+  }
+  if (i >= tokens_get_length(tokens)) {
+    status = usage();
+    goto done;
+  }
+  if (!quiet) {
+    fflush(stdout);
+    destinations[length].fd = STDOUT_FILENO;
+    destinations[length++].capture = NULL;
+  } else if (length == 0) {
+    destinations[length].fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    destinations[length++].capture = NULL;
+  }
+
+  int out[2];
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    perror("capture: pipe");
+    status = 1;
+    goto done;
+  }
+  struct spawn_attr attr;
+  spawn_attr_init(&attr);
+  attr.stdout_fd = out[1];
+  struct pipeline *pipeline = pipeline_from_words(tokens, i);
+  struct job *job = job_spawn(pipeline, true, &attr);
+  pipeline_destroy(pipeline);
+  close(out[1]);
+
+  pump(out[0], destinations, length, job);
+  close(out[0]);
+
+  status = job_foreground(job, false);
+  if (job_is_completed(job))
+    job_remove(job);
+
+done:
+  for (size_t d = 0; d < length; d++)
+    if (destinations[d].fd > STDERR_FILENO)
+      close(destinations[d].fd);
+  return status;
+}
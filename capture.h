@@ -0,0 +1,9 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Built-in: `capture [-q] [-o FILE] [-a FILE] [-m NAME] [-r NAME:SIZE]... COMMAND...' copies
+ * COMMAND's output to stdout (unless -q) and to each destination: files to truncate (-o) or
+ * append to (-a), a named memory buffer (-m), or a named ring buffer keeping the last SIZE
+ * bytes (-r). `capture -p NAME' prints a buffer and `capture -d NAME' drops it. */
+int cmd_capture(struct tokens *tokens);
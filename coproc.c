@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coproc.h"
+#include "job.h"
+#include "parse.h"
+#include "timing.h"
+#include "vars.h"
+
+#define CHANNEL_SIZE (64 * 1024)
+
+/* One direction of the pipes to a coprocess, with the bytes buffered on the shell's side:
+ * lines waiting to be written, or read ahead of the next line */
+struct channel {
+  int fd;
+  size_t length;
+  char buf[CHANNEL_SIZE];
+};
+
+/* A helper started by `coproc', running as a background job with its stdin and stdout
+ * connected to the shell */
+struct coproc {
+  struct coproc *next;
+  char *name;
+  int job_id;
+  pid_t pid;
+  struct channel to;
+  struct channel from;
+};
+
+static struct coproc *coprocs;
+
+static struct coproc *coproc_find(const char *name) {
+  for (struct coproc *coproc = coprocs; coproc != NULL; coproc = coproc->next)
+    if (strcmp(coproc->name, name) == 0)
+      return coproc;
+  return NULL;
+}
+
+/* Writes out everything queued for the coprocess. A coprocess that has gone away shows up as
+ * an error rather than a SIGPIPE that would kill the shell. */
+static int coproc_flush(struct coproc *coproc) {
+  struct sigaction ignore = {.sa_handler = SIG_IGN}, saved;
+  sigaction(SIGPIPE, &ignore, &saved);
+  size_t done = 0;
+  int result = 0;
+  while (done < coproc->to.length) {
+    ssize_t written = write(coproc->to.fd, coproc->to.buf + done, coproc->to.length - done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0) {
+      fprintf(stderr, "coproc: %s: %s\n", coproc->name, strerror(errno));
+      result = -1;
+      break;
+    }
+    done += written;
+  }
+  sigaction(SIGPIPE, &saved, NULL);
+  coproc->to.length = 0;
+  return result;
+}
+
+/* Adds n bytes to what is waiting to be written, writing it out whenever the buffer fills up */
+static int coproc_queue(struct coproc *coproc, const char *data, size_t n) {
+  while (n > 0) {
+    if (coproc->to.length == sizeof(coproc->to.buf) && coproc_flush(coproc) < 0)
+      return -1;
+    size_t space = sizeof(coproc->to.buf) - coproc->to.length;
+    size_t chunk = n < space ? n : space;
+    memcpy(coproc->to.buf + coproc->to.length, data, chunk);
+    coproc->to.length += chunk;
+    data += chunk;
+    n -= chunk;
+  }
+  return 0;
+}
+
+/* Closes the shell's ends of the pipes, which the coprocess sees as end of file, and forgets
+ * it. Its job is reaped and reported like any other background job. */
+static void coproc_close(struct coproc *coproc) {
+  coproc_flush(coproc);
+  for (struct coproc **link = &coprocs; *link != NULL; link = &(*link)->next) {
+    if (*link == coproc) {
+      *link = coproc->next;
+      break;
+    }
+  }
+  close(coproc->to.fd);
+  close(coproc->from.fd);
+  free(coproc->name);
+  free(coproc);
+}
+
+static int coproc_start(const char *name, struct tokens *tokens, size_t start) {
+  if (coproc_find(name) != NULL) {
+    fprintf(stderr, "coproc: %s: already running\n", name);
+    return 1;
+  }
+
+  int to[2], from[2];
+  if (pipe2(to, O_CLOEXEC) < 0) {
+    perror("coproc: pipe");
+    return 1;
+  }
+  if (pipe2(from, O_CLOEXEC) < 0) {
+    perror("coproc: pipe");
+    close(to[0]);
+    close(to[1]);
+    return 1;
+  }
+
+  struct spawn_attr attr;
+  spawn_attr_init(&attr);
+  attr.stdin_fd = to[0];
+  attr.stdout_fd = from[1];
+  struct pipeline *pipeline = pipeline_from_words(tokens, start);
+  struct job *job = job_spawn(pipeline, false, &attr);
+  pipeline_destroy(pipeline);
+  close(to[0]);
+  close(from[1]);
+
+  struct coproc *coproc = (struct coproc *) malloc(sizeof(struct coproc));
+  coproc->name = strdup(name);
+  coproc->job_id = job->id;
+  coproc->pid = job->length > 0 ? job->processes[job->length - 1].pid : -1;
+  coproc->to.fd = to[1];
+  coproc->to.length = 0;
+  coproc->from.fd = from[0];
+  coproc->from.length = 0;
+  coproc->next = coprocs;
+  coprocs = coproc;
+  fprintf(stderr, "[%d] %d\n", coproc->job_id, (int) coproc->pid);
+  return 0;
+}
+
+int cmd_coproc(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  char *option = tokens_get_token(tokens, 1);
+  if (option == NULL) {
+    for (struct coproc *coproc = coprocs; coproc != NULL; coproc = coproc->next)
+      printf("%s\t[%d] %d\n", coproc->name, coproc->job_id, (int) coproc->pid);
+    return 0;
+  }
+
+  if (strcmp(option, "-c") == 0 && length == 3) {
+    struct coproc *coproc = coproc_find(tokens_get_token(tokens, 2));
+    if (coproc == NULL) {
+      fprintf(stderr, "coproc: %s: no such coprocess\n", tokens_get_token(tokens, 2));
+      return 1;
+    }
+    coproc_close(coproc);
+    return 0;
+  }
+  if (strcmp(option, "-n") == 0 && length > 3)
+    return coproc_start(tokens_get_token(tokens, 2), tokens, 3);
+  if (option[0] != '-')
+    return coproc_start("COPROC", tokens, 1);
+
+  fprintf(stderr, "usage: coproc [-n NAME] COMMAND... | coproc -c NAME\n");
+  return 2;
+}
+
+int cmd_cosend(struct tokens *tokens) {
+  size_t i = 1;
+  bool flush = false;
+  if (tokens_get_token(tokens, i) != NULL && strcmp(tokens_get_token(tokens, i), "-f") == 0) {
+    flush = true;
+    i++;
+  }
+  char *name = tokens_get_token(tokens, i++);
+  if (name == NULL) {
+    fprintf(stderr, "usage: cosend [-f] NAME [WORD]...\n");
+    return 2;
+  }
+  struct coproc *coproc = coproc_find(name);
+  if (coproc == NULL) {
+    fprintf(stderr, "cosend: %s: no such coprocess\n", name);
+    return 1;
+  }
+
+  /* The words go out as one line, joined by spaces */
+  for (size_t first = i; i < tokens_get_length(tokens); i++) {
+    char *word = tokens_get_token(tokens, i);
+    if ((i > first && coproc_queue(coproc, " ", 1) < 0) ||
+        coproc_queue(coproc, word, strlen(word)) < 0)
+      return 1;
+  }
+  if (coproc_queue(coproc, "\n", 1) < 0)
+    return 1;
+  return flush && coproc_flush(coproc) < 0 ? 1 : 0;
+}
+
+static volatile sig_atomic_t sigint_caught;
+
+static void interrupted(int sig) {
+  sigint_caught = 1;
+}
+
+/* Prints the next line from the coprocess, waiting for it for up to timeout_ns (forever if
+ * negative). Returns 124 on a timeout and 130 on ^C. */
+/* Prints n bytes of a line, or assigns them to var without the newline */
+static int corecv_deliver(const char *data, size_t n, const char *var) {
+  if (var == NULL) {
+    fwrite(data, 1, n, stdout);
+    return 0;
+  }
+  if (n > 0 && data[n - 1] == '\n')
+    n--;
+  char *line = strndup(data, n);
+  int result = vars_assign_text(var, line);
+  free(line);
+  return result < 0 ? 1 : 0;
+}
+
+static int corecv_wait(struct coproc *coproc, long long timeout_ns, const char *var) {
+  uint64_t deadline = timeout_ns < 0 ? 0 : clock_now_ns() + timeout_ns;
+  struct channel *from = &coproc->from;
+  for (;;) {
+    char *newline = memchr(from->buf, '\n', from->length);
+    size_t n = newline ? (size_t) (newline - from->buf) + 1 : 0;
+    if (n == 0 && from->length == sizeof(from->buf))
+      n = from->length;
+    if (n > 0) {
+      int status = corecv_deliver(from->buf, n, var);
+      memmove(from->buf, from->buf + n, from->length - n);
+      from->length -= n;
+      return status;
+    }
+
+    int timeout_ms = -1;
+    if (timeout_ns >= 0) {
+      uint64_t now = clock_now_ns();
+      timeout_ms = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+    }
+    struct pollfd pollfd = {.fd = from->fd, .events = POLLIN};
+    int ready = poll(&pollfd, 1, timeout_ms);
+    if (sigint_caught)
+      return 128 + SIGINT;
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready == 0)
+      return 124;
+
+    ssize_t got = read(from->fd, from->buf + from->length, sizeof(from->buf) - from->length);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      /* End of file: hand out a last unterminated line, if there is one */
+      if (from->length == 0)
+        return 1;
+      int status = corecv_deliver(from->buf, from->length, var);
+      from->length = 0;
+      return status;
+    }
+    from->length += got;
+  }
+}
+
+int cmd_corecv(struct tokens *tokens) {
+  size_t i = 1;
+  long long timeout_ns = -1;
+  if (tokens_get_token(tokens, i) != NULL && strcmp(tokens_get_token(tokens, i), "-t") == 0) {
+    char *value = tokens_get_token(tokens, i + 1);
+    if (value == NULL || (timeout_ns = parse_duration(value)) < 0) {
+      fprintf(stderr, "corecv: invalid timeout: %s\n", value ? value : "");
+      return 2;
+    }
+    i += 2;
+  }
+  char *name = tokens_get_token(tokens, i), *var = tokens_get_token(tokens, i + 1);
+  if (name == NULL || i + 2 < tokens_get_length(tokens)) {
+    fprintf(stderr, "usage: corecv [-t DURATION] NAME [VAR]\n");
+    return 2;
+  }
+  if (var != NULL && !is_name(var, strlen(var))) {
+    fprintf(stderr, "corecv: `%s': not a valid identifier\n", var);
+    return 2;
+  }
+  struct coproc *coproc = coproc_find(name);
+  if (coproc == NULL) {
+    fprintf(stderr, "corecv: %s: no such coprocess\n", name);
+    return 1;
+  }
+
+  /* Whatever was sent is what the coprocess is expected to answer */
+  if (coproc->to.length > 0 && coproc_flush(coproc) < 0)
+    return 1;
+
+  /* SIGINT is caught for the wait, even if the shell ignores it, so that ^C gets the shell back
+   * from a coprocess that never answers */
+  struct sigaction action, old;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupted;
+  sigemptyset(&action.sa_mask);
+  sigint_caught = 0;
+  sigaction(SIGINT, &action, &old);
+  int status = corecv_wait(coproc, timeout_ns, var);
+  sigaction(SIGINT, &old, NULL);
+  return status;
+}
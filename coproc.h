@@ -0,0 +1,17 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Built-in: `coproc [-n NAME] COMMAND...' starts COMMAND as a background job whose stdin and
+ * stdout are pipes to the shell, under NAME (COPROC by default). `coproc -c NAME' closes the
+ * pipes and `coproc' lists the coprocesses. */
+int cmd_coproc(struct tokens *tokens);
+
+/* Built-in: `cosend [-f] NAME WORD...' queues the words as a line for the coprocess. Lines are
+ * buffered until the buffer fills, the next corecv, or -f. */
+int cmd_cosend(struct tokens *tokens);
+
+/* Built-in: `corecv [-t DURATION] NAME [VAR]' prints the next line from the coprocess, or
+ * assigns it to VAR without its newline. The status is 1 at end of file and 124 if nothing came
+ * within DURATION. */
+int cmd_corecv(struct tokens *tokens);
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "timing.h"
+
+/* Events in flight at most, which is also the size asked for the completion queue so that it
+ * can never overflow; each child the shell watches takes one. The table grows a block at a
+ * time, and the blocks never move, as the kernel holds on to the timespecs in them. */
+#define MAX_EVENTS 4096
+#define EVENT_BLOCK 64
+#define SQ_ENTRIES 64
+
+enum event_kind { EVENT_FREE, EVENT_READ, EVENT_POLL, EVENT_TIMEOUT };
+
+/* An operation in flight; its slot number is the io_uring user_data */
+struct event {
+  enum event_kind kind;
+  int fd;
+  void *buf;
+  size_t len;
+  short poll_events;
+  uint64_t deadline_ns;
+  struct __kernel_timespec ts;
+  event_fn *fn;
+  void *data;
+};
+
+static struct event *event_blocks[MAX_EVENTS / EVENT_BLOCK];
+static int events_capacity;
+/* MAX_EVENTS, or less if the kernel made a smaller completion queue */
+static int events_limit = MAX_EVENTS;
+
+#define EVENT(slot) (&event_blocks[(slot) / EVENT_BLOCK][(slot) % EVENT_BLOCK])
+
+/* The io_uring, mapped into our memory. fd is -1 when the kernel won't give us one, in which
+ * case everything goes through poll() instead. */
+static struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+} ring = {.fd = -1};
+
+static bool initialized;
+
+static int ring_setup(void) {
+#ifdef SYS_io_uring_setup
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = MAX_EVENTS;
+  int fd = syscall(SYS_io_uring_setup, SQ_ENTRIES, &params);
+  if (fd < 0 && errno == EINVAL) {
+    /* Before Linux 5.5 the completion queue is twice the submission queue */
+    memset(&params, 0, sizeof(params));
+    fd = syscall(SYS_io_uring_setup, MAX_EVENTS / 2, &params);
+  }
+  if (fd < 0)
+    return -1;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+      IORING_OFF_SQ_RING);
+  char *cq = sq;
+  if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  ring.fd = fd;
+  ring.entries = params.sq_entries;
+  ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring.sqes = (struct io_uring_sqe *) sqes;
+  ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  if (params.cq_entries < MAX_EVENTS)
+    events_limit = params.cq_entries;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+void evloop_init(void) {
+  if (initialized)
+    return;
+  initialized = true;
+  ring_setup();
+}
+
+void evloop_detach(void) {
+  if (ring.fd >= 0)
+    close(ring.fd);
+  ring.fd = -1;
+  ring.to_submit = 0;
+  events_limit = MAX_EVENTS;
+  for (int slot = 0; slot < events_capacity; slot += EVENT_BLOCK)
+    memset(event_blocks[slot / EVENT_BLOCK], 0, sizeof(struct event) * EVENT_BLOCK);
+  initialized = true;
+}
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(SYS_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Fills in a submission queue entry for the event in slot */
+static void ring_queue(int slot) {
+  struct event *event = EVENT(slot);
+  unsigned tail = *ring.sq_tail;
+  if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+    /* More events than the submission queue holds; hand what we have to the kernel */
+    if (ring_enter(ring.to_submit, 0, 0) > 0)
+      ring.to_submit = 0;
+  }
+
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = slot;
+  sqe->fd = event->fd;
+  switch (event->kind) {
+    case EVENT_READ:
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (uintptr_t) event->buf;
+      sqe->len = event->len;
+      sqe->off = (uint64_t) -1;
+      break;
+    case EVENT_POLL:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = event->poll_events;
+      break;
+    default:
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (uintptr_t) &event->ts;
+      sqe->len = 1;
+      break;
+  }
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.to_submit++;
+}
+
+/* Claims a free slot for a new event, adding a block if they are all taken, and queues it;
+ * returns -1 if the limit is reached */
+static int event_add(struct event *event) {
+  evloop_init();
+  int slot = 0;
+  while (slot < events_capacity && EVENT(slot)->kind != EVENT_FREE)
+    slot++;
+  if (slot == events_capacity) {
+    struct event *block = events_capacity + EVENT_BLOCK <= events_limit ?
+        (struct event *) calloc(EVENT_BLOCK, sizeof(struct event)) : NULL;
+    if (block == NULL) {
+      fprintf(stderr, "shell: too many pending events\n");
+      return -1;
+    }
+    event_blocks[events_capacity / EVENT_BLOCK] = block;
+    events_capacity += EVENT_BLOCK;
+  }
+  *EVENT(slot) = *event;
+  if (ring.fd >= 0)
+    ring_queue(slot);
+  return 0;
+}
+
+int evloop_read(int fd, void *buf, size_t len, event_fn *fn, void *data) {
+  struct event event = {.kind = EVENT_READ, .fd = fd, .buf = buf, .len = len,
+      .fn = fn, .data = data};
+  return event_add(&event);
+}
+
+int evloop_poll(int fd, short events, event_fn *fn, void *data) {
+  struct event event = {.kind = EVENT_POLL, .fd = fd, .poll_events = events,
+      .fn = fn, .data = data};
+  return event_add(&event);
+}
+
+int evloop_timeout(uint64_t ns, event_fn *fn, void *data) {
+  struct event event = {.kind = EVENT_TIMEOUT, .fd = -1, .fn = fn, .data = data};
+  event.deadline_ns = clock_now_ns() + ns;
+  event.ts.tv_sec = ns / 1000000000;
+  event.ts.tv_nsec = ns % 1000000000;
+  return event_add(&event);
+}
+
+/* Frees the slot and runs its callback */
+static void event_complete(int slot, int result) {
+  event_fn *fn = EVENT(slot)->fn;
+  void *data = EVENT(slot)->data;
+  EVENT(slot)->kind = EVENT_FREE;
+  fn(data, result);
+}
+
+static void ring_run_once(void) {
+  int submitted = ring_enter(ring.to_submit, 1, IORING_ENTER_GETEVENTS);
+  if (submitted > 0)
+    ring.to_submit -= submitted;
+
+  /* Take every completion that is ready, not just the first */
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  int slots[events_capacity + 1], results[events_capacity + 1], length = 0;
+  for (; head != tail && length < events_capacity; head++) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    slots[length] = cqe->user_data;
+    results[length++] = cqe->res;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < length; i++) {
+    if (EVENT(slots[i])->kind == EVENT_TIMEOUT && results[i] == -ETIME)
+      results[i] = 0;
+    event_complete(slots[i], results[i]);
+  }
+}
+
+static void poll_run_once(void) {
+  struct pollfd fds[events_capacity + 1];
+  int slots[events_capacity + 1], length = 0, timeout = -1;
+  uint64_t now = clock_now_ns();
+
+  for (int slot = 0; slot < events_capacity; slot++) {
+    struct event *event = EVENT(slot);
+    if (event->kind == EVENT_READ || event->kind == EVENT_POLL) {
+      fds[length].fd = event->fd;
+      fds[length].events = event->kind == EVENT_READ ? POLLIN : event->poll_events;
+      slots[length++] = slot;
+    } else if (event->kind == EVENT_TIMEOUT) {
+      uint64_t left = event->deadline_ns > now ? event->deadline_ns - now : 0;
+      int ms = (left + 999999) / 1000000;
+      if (timeout < 0 || ms < timeout)
+        timeout = ms;
+    }
+  }
+
+  int ready = poll(fds, length, timeout);
+  for (int i = 0; ready > 0 && i < length; i++) {
+    if (fds[i].revents == 0)
+      continue;
+    struct event *event = EVENT(slots[i]);
+    int result = fds[i].revents;
+    if (event->kind == EVENT_READ) {
+      ssize_t n = read(event->fd, event->buf, event->len);
+      result = n < 0 ? -errno : n;
+    }
+    event_complete(slots[i], result);
+  }
+
+  now = clock_now_ns();
+  for (int slot = 0; slot < events_capacity; slot++)
+    if (EVENT(slot)->kind == EVENT_TIMEOUT && EVENT(slot)->deadline_ns <= now)
+      event_complete(slot, 0);
+}
+
+void evloop_run_once(void) {
+  evloop_init();
+  if (ring.fd >= 0)
+    ring_run_once();
+  else
+    poll_run_once();
+}
+
+/* Input read ahead of the current line */
+static struct {
+  char buf[4096];
+  size_t length;
+  bool pending;
+  bool eof;
+} input;
+
+static void input_done(void *data, int result) {
+  input.pending = false;
+  if (result == -EINTR || result == -EAGAIN)
+    return;
+  if (result <= 0)
+    input.eof = true;
+  else
+    input.length += result;
+}
+
+char *evloop_getline(int fd, char *line, size_t size) {
+  /* Make sure the prompt is out before waiting, as stdio does when reading from stdin */
+  fflush(stdout);
+  for (;;) {
+    char *newline = memchr(input.buf, '\n', input.length);
+    size_t n = newline ? (size_t) (newline - input.buf) + 1 : 0;
+    if (n == 0 && (input.eof || input.length == sizeof(input.buf)))
+      n = input.length;
+    if (n > 0) {
+      if (n > size - 1)
+        n = size - 1;
+      memcpy(line, input.buf, n);
+      line[n] = '\0';
+      memmove(input.buf, input.buf + n, input.length - n);
+      input.length -= n;
+      return line;
+    }
+    if (input.eof)
+      return NULL;
+
+    if (!input.pending) {
+      if (evloop_read(fd, input.buf + input.length, sizeof(input.buf) - input.length,
+          input_done, NULL) < 0)
+        return NULL;
+      input.pending = true;
+    }
+    evloop_run_once();
+  }
+}
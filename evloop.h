@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Called when an operation completes, with its result: a byte count for reads, the ready
+ * events for polls, 0 for timeouts, or a negative errno */
+typedef void event_fn(void *data, int result);
+
+/* Sets up the event loop: an io_uring if the kernel allows one, poll() otherwise */
+void evloop_init(void);
+
+/* Forgets the event loop in a child process, so that it never touches the parent's io_uring;
+ * the child falls back to poll() */
+void evloop_detach(void);
+
+/* Queues a read of up to len bytes from fd into buf */
+int evloop_read(int fd, void *buf, size_t len, event_fn *fn, void *data);
+
+/* Queues a one-shot wait for fd to have one of the poll events */
+int evloop_poll(int fd, short events, event_fn *fn, void *data);
+
+/* Queues a one-shot timer that fires after ns nanoseconds */
+int evloop_timeout(uint64_t ns, event_fn *fn, void *data);
+
+/* Submits everything queued, waits for at least one completion and runs the callbacks of all
+ * the completions that are ready */
+void evloop_run_once(void);
+
+/* Reads a line (including the newline) into line, running the event loop while waiting for
+ * input. Returns NULL at end of input, like fgets(). */
+char *evloop_getline(int fd, char *line, size_t size);
@@ -0,0 +1,1044 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/close_range.h>
+#include <linux/sched.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "job.h"
+#include "metrics.h"
+#include "pool.h"
+#include "shell.h"
+#include "timing.h"
+#include "vars.h"
+
+extern char **environ;
+
+struct job *first_job;
+
+/* Signals the shell ignores while it has job control and its children get back */
+static const int job_control_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+#define JOB_CONTROL_SIGNALS (sizeof(job_control_signals) / sizeof(job_control_signals[0]))
+
+static void job_watch(struct job *job);
+static void job_reap(void);
+static void command_exec(struct command *command);
+
+char *path_resolve(const char *name) {
+  if (strchr(name, '/') != NULL)
+    return strdup(name);
+
+  const char *path = getenv("PATH");
+  if (path == NULL)
+    path = "/usr/local/bin:/usr/bin:/bin";
+
+  size_t name_length = strlen(name);
+  while (*path) {
+    const char *end = strchr(path, ':');
+    size_t dir_length = end ? (size_t) (end - path) : strlen(path);
+    char *candidate = (char *) malloc(dir_length + name_length + 3);
+    if (dir_length == 0)
+      strcpy(candidate, ".");
+    else
+      memcpy(candidate, path, dir_length), candidate[dir_length] = '\0';
+    strcat(candidate, "/");
+    strcat(candidate, name);
+
+    struct stat st;
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+      return candidate;
+    free(candidate);
+    path += dir_length + (end ? 1 : 0);
+  }
+  return NULL;
+}
+
+/* Opens the file a redirection names, once its path is expanded. Returns -1 if it can't, with
+ * a message if report is set. */
+static int redirect_open(struct redirect *redirect, bool report) {
+  char *path = vars_expand(redirect->path);
+  int fd = open(path, redirect->flags | O_CLOEXEC, 0666);
+  if (fd < 0 && report)
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+  free(path);
+  return fd;
+}
+
+int redirects_apply(struct command *command, int saved[3]) {
+  for (size_t i = 0; i < command->redirects_length; i++) {
+    struct redirect *redirect = &command->redirects[i];
+    int fd = redirect_open(redirect, true);
+    if (fd < 0)
+      return -1;
+    if (saved != NULL && saved[redirect->fd] < 0)
+      saved[redirect->fd] = fcntl(redirect->fd, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, redirect->fd);
+    close(fd);
+  }
+  return 0;
+}
+
+void redirects_restore(int saved[3]) {
+  fflush(stdout);
+  fflush(stderr);
+  for (int fd = 0; fd < 3; fd++) {
+    if (saved[fd] >= 0) {
+      dup2(saved[fd], fd);
+      close(saved[fd]);
+      saved[fd] = -1;
+    }
+  }
+}
+
+/* Runs a list in a child as a subshell: this copy of the shell, without job control. A list
+ * of one simple command is executed directly. */
+static void subshell_exec(struct list *list) {
+  struct pipeline *pipeline = list->length == 1 ? list->items[0].pipeline : NULL;
+  if (pipeline != NULL && pipeline->length == 1 && pipeline->flags == 0 &&
+      pipeline->commands[0].substitutions_length == 0 && pipeline->commands[0].subshell == NULL)
+    command_exec(&pipeline->commands[0]);
+
+  evloop_detach();
+  shell_is_interactive = false;
+  first_job = NULL;
+  int status = run_list(list);
+  fflush(stdout);
+  _exit(status);
+}
+
+/* Runs one stage of a pipeline in the child process; never returns */
+static void command_exec(struct command *command) {
+  if (command->subshell != NULL) {
+    if (redirects_apply(command, NULL) < 0)
+      _exit(1);
+    subshell_exec(command->subshell);
+  }
+
+  /* Prefix assignments only reach this process, and the command's environment */
+  struct tokens *expanded = vars_expand_words(command->words);
+  if (expanded != NULL)
+    command->words = expanded;
+  for (size_t i = 0; i < command->assignments_length; i++)
+    if (vars_assign(&command->assignments[i], true) < 0)
+      _exit(1);
+  if (redirects_apply(command, NULL) < 0)
+    _exit(1);
+
+  char *name = tokens_get_token(command->words, 0);
+  if (name == NULL)
+    _exit(0);
+  int fundex = lookup(name);
+  if (fundex >= 0) {
+    int status = cmd_table[fundex].fun(command->words);
+    fflush(stdout);
+    _exit(status);
+  }
+
+  char *path = path_resolve(name);
+  if (path == NULL) {
+    fprintf(stderr, "shell: %s: command not found\n", name);
+    _exit(127);
+  }
+
+  struct flat_tokens *flat = tokens_flatten(command->words);
+  if (flat == NULL) {
+    fprintf(stderr, "shell: %s: %s\n", name, strerror(E2BIG));
+    _exit(126);
+  }
+  char *argv[flat_tokens_get_length(flat) + 1];
+  execv(path, flat_tokens_argv(flat, argv));
+  fprintf(stderr, "shell: %s: %s\n", name, strerror(errno));
+  _exit(errno == ENOENT ? 127 : 126);
+}
+
+void job_control_init(void) {
+  for (size_t i = 0; i < JOB_CONTROL_SIGNALS; i++)
+    signal(job_control_signals[i], SIG_IGN);
+}
+
+void job_control_reset(void) {
+  for (size_t i = 0; i < JOB_CONTROL_SIGNALS; i++)
+    signal(job_control_signals[i], SIG_DFL);
+}
+
+/* Joins the words of every stage into the job's command line, for job listings */
+static char *pipeline_text(struct pipeline *pipeline) {
+  size_t size = 1;
+  for (size_t i = 0; i < pipeline->length; i++) {
+    struct command *command = &pipeline->commands[i];
+    if (command->subshell != NULL)
+      size += strlen(command->subshell->text) + 3;
+    for (size_t j = 0; j < tokens_get_length(command->words); j++)
+      size += strlen(tokens_get_token(command->words, j)) + 3;
+  }
+
+  char *text = (char *) malloc(size);
+  text[0] = '\0';
+  for (size_t i = 0; i < pipeline->length; i++) {
+    struct command *command = &pipeline->commands[i];
+    if (i > 0)
+      strcat(text, " | ");
+    if (command->subshell != NULL)
+      strcat(text, command->subshell->text);
+    for (size_t j = 0; j < tokens_get_length(command->words); j++) {
+      if (j > 0)
+        strcat(text, " ");
+      strcat(text, tokens_get_token(command->words, j));
+    }
+  }
+  /* Show references as they were typed */
+  for (char *c = strchr(text, TOKEN_EXPAND); c != NULL; c = strchr(c, TOKEN_EXPAND))
+    *c = '$';
+  return text;
+}
+
+/* The smallest job number not in use */
+static int next_job_id(void) {
+  int id = 1;
+  for (struct job *job = first_job; job != NULL; job = job->next)
+    if (job->id >= id)
+      id = job->id + 1;
+  return id;
+}
+
+static void job_add(struct job *job) {
+  struct job **tail = &first_job;
+  while (*tail != NULL)
+    tail = &(*tail)->next;
+  *tail = job;
+}
+
+void spawn_attr_init(struct spawn_attr *attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->cgroup_fd = -1;
+  attr->stdin_fd = -1;
+  attr->stdout_fd = -1;
+}
+
+/* fork(), but with clone3() where the kernel has it: CLONE_PIDFD hands back a pidfd for the
+ * child in the same syscall (-1 in *pidfd otherwise), and CLONE_INTO_CGROUP places it in the
+ * attribute's cgroup atomically. Kernels without them fall back to fork() and, for a cgroup, a
+ * write to cgroup.procs in the child. */
+static pid_t spawn_fork(const struct spawn_attr *attr, int *pidfd) {
+  bool cgroup = attr != NULL && attr->cgroup_fd >= 0;
+  pid_t pid;
+  *pidfd = -1;
+#ifdef SYS_clone3
+  static bool no_clone3;
+  if (!no_clone3) {
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_PIDFD | (cgroup ? CLONE_INTO_CGROUP : 0);
+    args.pidfd = (uint64_t) (uintptr_t) pidfd;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = cgroup ? attr->cgroup_fd : 0;
+    pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+      return pid;
+    no_clone3 = errno == ENOSYS;
+    *pidfd = -1;
+  }
+#endif
+
+  pid = fork();
+  if (pid == 0 && cgroup) {
+    int fd = openat(attr->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "0", 1) != 1) {
+      perror("shell: cgroup.procs");
+      _exit(1);
+    }
+    close(fd);
+  }
+  return pid;
+}
+
+/* Setup from the spawn attributes, done in the child */
+static void spawn_attr_apply(const struct spawn_attr *attr, const struct placement *placement) {
+  if (placement != NULL && placement_apply(placement) < 0) {
+    perror("shell: placement");
+    _exit(1);
+  }
+  if (attr == NULL)
+    return;
+  for (size_t i = 0; i < attr->rlimits_length; i++) {
+    if (setrlimit(attr->rlimits[i].resource, &attr->rlimits[i].limit) < 0) {
+      perror("shell: setrlimit");
+      _exit(1);
+    }
+  }
+}
+
+/* close_range() does this in one call however many descriptors the shell holds; older kernels
+ * get the open ones from /proc/self/fd rather than having every number up to RLIMIT_NOFILE
+ * tried */
+void fds_close_on_exec(void) {
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+    return;
+#endif
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int fd = atoi(entry->d_name);
+    if (fd > 2 && fd != dirfd(dir))
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  closedir(dir);
+}
+
+/* Forks a process of the job with in and out as its stdin and stdout. The child comes back with
+ * 0 once it has joined the job's process group and has its descriptors in place, all but 0-2
+ * close-on-exec; the parent records the process and gets its pid, or -1. */
+static pid_t process_spawn(struct job *job, const char *name, int in, int out, bool foreground,
+    const struct spawn_attr *attr, const struct placement *placement) {
+  bool own_group = shell_is_interactive || (attr != NULL && attr->process_group);
+  int pidfd;
+  pid_t pid = spawn_fork(attr, &pidfd);
+  if (pid == 0) {
+    if (own_group) {
+      /* Join the job's process group (the first process starts it) and take the terminal
+       * if the job runs in the foreground. Both are done by the shell as well, whichever
+       * gets there first. */
+      pid = getpid();
+      setpgid(pid, job->pgid ? job->pgid : pid);
+    }
+    if (shell_is_interactive) {
+      if (foreground)
+        tcsetpgrp(shell_terminal, job->pgid ? job->pgid : pid);
+      job_control_reset();
+    }
+    if (in != STDIN_FILENO)
+      dup2(in, STDIN_FILENO);
+    if (out != STDOUT_FILENO)
+      dup2(out, STDOUT_FILENO);
+    fds_close_on_exec();
+    spawn_attr_apply(attr, placement);
+    return 0;
+  }
+
+  if (pid < 0) {
+    perror("shell: fork");
+    return -1;
+  }
+  if (own_group) {
+    if (job->pgid == 0)
+      job->pgid = pid;
+    setpgid(pid, job->pgid);
+  }
+  job->processes[job->length].name = strdup(name);
+  job->processes[job->length].pidfd = pidfd;
+  job->processes[job->length++].pid = pid;
+  return pid;
+}
+
+/* Starts a plain external command through a helper from the pool rather than a fork, working
+ * out its words, environment and redirections here instead of in a child. Returns the pid, or
+ * -1 without a message if the command has to be forked after all, so that the child can say
+ * what is wrong. */
+static pid_t process_spawn_pooled(struct job *job, struct command *command, const char *name,
+    int in, int out, bool foreground) {
+  if (!pool_ready() || command->subshell != NULL || command->substitutions_length > 0)
+    return -1;
+  for (size_t i = 0; i < command->assignments_length; i++)
+    if (command->assignments[i].key != NULL || command->assignments[i].array)
+      return -1;
+
+  struct tokens *expanded = vars_expand_words(command->words);
+  struct tokens *words = expanded ? expanded : command->words;
+  char *word = tokens_get_token(words, 0);
+  char *path = word != NULL && lookup(word) < 0 ? path_resolve(word) : NULL;
+  int fds[3] = {in, out, STDERR_FILENO}, opened[3] = {-1, -1, -1};
+  bool ready = path != NULL;
+  for (size_t i = 0; ready && i < command->redirects_length; i++) {
+    struct redirect *redirect = &command->redirects[i];
+    int fd = redirect_open(redirect, false);
+    if (fd >= 0 && opened[redirect->fd] >= 0)
+      close(opened[redirect->fd]);
+    if (fd >= 0)
+      fds[redirect->fd] = opened[redirect->fd] = fd;
+    ready = fd >= 0;
+  }
+
+  pid_t pid = -1;
+  if (ready) {
+    /* Prefix assignments reach the command's environment and nothing else */
+    vars_push_scope();
+    for (size_t i = 0; i < command->assignments_length; i++)
+      vars_assign(&command->assignments[i], true);
+    struct flat_tokens *flat = tokens_flatten(words);
+    char *argv[flat_tokens_get_length(flat) + 1];
+    /* Words too long to flatten are left to the forked child to report */
+    struct pool_request request = {
+      .path = path,
+      .argv = flat_tokens_argv(flat, argv),
+      .envp = environ,
+      .fds = {fds[0], fds[1], fds[2]},
+      .pgid = shell_is_interactive ? job->pgid : -1,
+      .foreground = foreground && shell_is_interactive,
+      .job_control = shell_is_interactive,
+    };
+    pid = flat != NULL ? pool_exec(&request) : -1;
+    flat_tokens_destroy(flat);
+    vars_pop_scope();
+  }
+  for (int i = 0; i < 3; i++)
+    if (opened[i] >= 0)
+      close(opened[i]);
+  free(path);
+  if (expanded != NULL)
+    tokens_destroy(expanded);
+  if (pid < 0)
+    return -1;
+
+  if (shell_is_interactive && job->pgid == 0)
+    job->pgid = pid;
+  job->processes[job->length].name = strdup(name);
+  job->processes[job->length].pidfd = syscall(SYS_pidfd_open, pid, 0);
+  job->processes[job->length++].pid = pid;
+  return pid;
+}
+
+/* Starts the process substitutions of a command as processes of the job. The shell's end of
+ * each pipe is left in fds (-1 if it couldn't be made), for the command to inherit; the children
+ * close the pipeline's pipes, which are the command's business. */
+static void substitutions_spawn(struct job *job, struct command *command, int *fds,
+    const int *pipes, size_t pipes_length, bool foreground, const struct spawn_attr *attr,
+    const struct placement *placement) {
+  for (size_t s = 0; s < command->substitutions_length; s++) {
+    struct substitution *substitution = &command->substitutions[s];
+    int pipe_fds[2];
+    fds[s] = -1;
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+      perror("shell: pipe");
+      continue;
+    }
+    int theirs = substitution->output ? pipe_fds[0] : pipe_fds[1];
+    fds[s] = substitution->output ? pipe_fds[1] : pipe_fds[0];
+
+    pid_t pid = process_spawn(job, substitution->list->text,
+        substitution->output ? theirs : STDIN_FILENO,
+        substitution->output ? STDOUT_FILENO : theirs, foreground, attr, placement);
+    if (pid == 0) {
+      close(fds[s]);
+      for (size_t p = 0; p < pipes_length; p++)
+        close(pipes[p]);
+      subshell_exec(substitution->list);
+    }
+    close(theirs);
+  }
+}
+
+/* In the child about to run command: hands it the substitution pipes in fds, which it keeps
+ * across exec, and puts their /dev/fd paths in place of the substitution words */
+static void substitutions_apply(struct command *command, const int *fds) {
+  if (command->substitutions_length == 0)
+    return;
+  struct tokens *words = tokens_new();
+  size_t s = 0;
+  for (size_t i = 0; i < tokens_get_length(command->words); i++) {
+    if (s < command->substitutions_length && command->substitutions[s].word == i) {
+      char path[32];
+      snprintf(path, sizeof(path), "/dev/fd/%d", fds[s]);
+      if (fds[s] >= 0)
+        fcntl(fds[s], F_SETFD, 0);
+      tokens_append(words, path, false);
+      s++;
+    } else {
+      tokens_append(words, tokens_get_token(command->words, i), false);
+    }
+  }
+  command->words = words;
+}
+
+/* Capacity for the pipes of pipelines that don't ask for one (`pipesize'); 0 leaves the
+ * kernel's default */
+static long long pipe_size_default;
+
+/* The most an unprivileged process may ask F_SETPIPE_SZ for, read once */
+static long long pipe_size_max(void) {
+  static long long max;
+  if (max == 0) {
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (file == NULL || fscanf(file, "%lld", &max) != 1 || max <= 0)
+      max = 1024 * 1024;
+    if (file != NULL)
+      fclose(file);
+  }
+  return max;
+}
+
+struct job *job_spawn(struct pipeline *pipeline, bool foreground,
+    const struct spawn_attr *attr) {
+  struct job *job = (struct job *) calloc(1, sizeof(struct job));
+  job->id = next_job_id();
+  job->command = pipeline_text(pipeline);
+  job->tmodes = shell_tmodes;
+  job->start_ns = clock_now_ns();
+
+  /* Process substitutions are processes of the job too, started just before their command */
+  size_t processes = pipeline->length;
+  for (size_t i = 0; i < pipeline->length; i++)
+    processes += pipeline->commands[i].substitutions_length;
+  job->processes = (struct process *) calloc(processes, sizeof(struct process));
+
+  /* The whole job goes to one place, so the stages of a pipeline share a NUMA node */
+  const struct placement *placement = attr && attr->placement ? attr->placement :
+      placement_default();
+  if (attr != NULL && attr->cgroup_path != NULL)
+    job->cgroup_path = strdup(attr->cgroup_path);
+  job_add(job);
+
+  /* Anything still buffered would otherwise be written once by every child */
+  fflush(stdout);
+  fflush(stderr);
+
+  /* Every pipe is made before the first fork, so that the stages start back to back rather
+   * than each waiting on the shell's bookkeeping for the one before. If they can't all be made,
+   * nothing is started. */
+  size_t pipes_length = 0;
+  int pipes[2 * pipeline->length];
+  long long pipe_size = pipeline->pipe_size > 0 ? pipeline->pipe_size : pipe_size_default;
+  if (pipe_size > pipe_size_max())
+    pipe_size = pipe_size_max();
+  for (size_t i = 0; i + 1 < pipeline->length; i++, pipes_length += 2) {
+    if (pipe2(pipes + pipes_length, O_CLOEXEC) < 0) {
+      perror("shell: pipe");
+      break;
+    }
+    /* A bigger pipe lets the stages run longer between switches. Failing (over the user's
+     * pipe-user-pages-soft, say) just leaves the default size. */
+    if (pipe_size > 0)
+      fcntl(pipes[pipes_length], F_SETPIPE_SZ, (int) pipe_size);
+  }
+  size_t stages = pipes_length / 2 + 1 == pipeline->length ? pipeline->length : 0;
+
+  /* The caller's descriptors stay open; only the pipes made here are closed */
+  int first_in = attr != NULL && attr->stdin_fd >= 0 ? attr->stdin_fd : STDIN_FILENO;
+  int last_out = attr != NULL && attr->stdout_fd >= 0 ? attr->stdout_fd : STDOUT_FILENO;
+  for (size_t i = 0; i < stages; i++) {
+    struct command *command = &pipeline->commands[i];
+    int in = i == 0 ? first_in : pipes[2 * i - 2];
+    int out = i + 1 == pipeline->length ? last_out : pipes[2 * i + 1];
+
+    int substitution_fds[command->substitutions_length + 1];
+    substitutions_spawn(job, command, substitution_fds, pipes, pipes_length, foreground, attr,
+        placement);
+
+    char *name = command->subshell ? command->subshell->text :
+        tokens_get_length(command->words) > 0 ? tokens_get_token(command->words, 0) : "";
+    /* Named after what runs, so that `$CMD' is counted under the command it expands to */
+    struct tokens *expanded = NULL;
+    if (command->subshell == NULL && strchr(name, TOKEN_EXPAND) != NULL) {
+      expanded = vars_expand_words(command->words);
+      name = expanded && tokens_get_length(expanded) > 0 ? tokens_get_token(expanded, 0) : "";
+    }
+    pid_t pid = attr == NULL && placement == NULL ?
+        process_spawn_pooled(job, command, name, in, out, foreground) : -1;
+    if (pid < 0)
+      pid = process_spawn(job, name, in, out, foreground, attr, placement);
+    if (expanded != NULL)
+      tokens_destroy(expanded);
+    if (pid == 0) {
+      /* Its own ends are in place as stdin and stdout by now */
+      for (size_t p = 0; p < pipes_length; p++)
+        close(pipes[p]);
+      substitutions_apply(command, substitution_fds);
+      command_exec(command);
+    }
+
+    for (size_t s = 0; s < command->substitutions_length; s++)
+      if (substitution_fds[s] >= 0)
+        close(substitution_fds[s]);
+    if (pid < 0)
+      break;
+  }
+  for (size_t p = 0; p < pipes_length; p++)
+    close(pipes[p]);
+  /* With the job under way, the pool can take its time to replace the helpers it used */
+  pool_refill();
+  if (!foreground)
+    job_watch(job);
+  return job;
+}
+
+/* Records the new state of a child reported by wait4(). Returns -1 if there was nothing to
+ * record. */
+static int mark_process_status(pid_t pid, int status, struct rusage *usage) {
+  if (pid <= 0)
+    return -1;
+  for (struct job *job = first_job; job != NULL; job = job->next) {
+    for (size_t i = 0; i < job->length; i++) {
+      struct process *process = &job->processes[i];
+      if (process->pid != pid)
+        continue;
+      process->status = status;
+      if (WIFSTOPPED(status)) {
+        process->stopped = true;
+        job->notified = false;
+      } else {
+        process->completed = true;
+        rusage_add(&job->usage, usage);
+        metrics_record(process->name, clock_now_ns() - job->start_ns);
+      }
+      return 0;
+    }
+  }
+  /* Not in the job table */
+  return 0;
+}
+
+/* The wait status that wait4() would have reported for a child waitid() found */
+static int siginfo_status(const siginfo_t *info) {
+  switch (info->si_code) {
+  case CLD_EXITED:
+    return (info->si_status & 0xff) << 8;
+  case CLD_DUMPED:
+    return info->si_status | 0x80;
+  default:
+    return info->si_status;
+  }
+}
+
+/* Waits on the pidfds of the job's processes through one epoll set, reaping each one with
+ * waitid(P_PIDFD) as it exits. pidfds only report exits, so this is for a shell without job
+ * control, and is skipped if any process lacks a pidfd. */
+static void job_wait_pidfds(struct job *job) {
+  for (size_t i = 0; i < job->length; i++)
+    if (job->processes[i].pidfd < 0)
+      return;
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+    return;
+
+  size_t waiting = 0;
+  for (size_t i = 0; i < job->length; i++) {
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = i};
+    if (!job->processes[i].completed &&
+        epoll_ctl(epfd, EPOLL_CTL_ADD, job->processes[i].pidfd, &event) == 0)
+      waiting++;
+  }
+  while (waiting > 0) {
+    struct epoll_event events[16];
+    int ready = epoll_wait(epfd, events, 16, -1);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      break;
+    for (int e = 0; e < ready; e++) {
+      struct process *process = &job->processes[events[e].data.u64];
+      siginfo_t info;
+      struct rusage usage;
+      info.si_pid = 0;
+      /* The raw syscall, unlike glibc's waitid(), also reports the child's resource usage */
+      if (syscall(SYS_waitid, P_PIDFD, process->pidfd, &info, WEXITED, &usage) == 0 &&
+          info.si_pid != 0)
+        mark_process_status(info.si_pid, siginfo_status(&info), &usage);
+      epoll_ctl(epfd, EPOLL_CTL_DEL, process->pidfd, NULL);
+      waiting--;
+    }
+  }
+  close(epfd);
+}
+
+/* Opens a signalfd that becomes readable when a child changes state, which, unlike a pidfd,
+ * includes stopping. SIGCHLD is blocked until child_events_close(). */
+static int child_events_open(sigset_t *old) {
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, old);
+  int fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    sigprocmask(SIG_SETMASK, old, NULL);
+  return fd;
+}
+
+static void child_events_close(int fd, const sigset_t *old) {
+  close(fd);
+  sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+/* Empties the signalfd; the children themselves are found by job_reap() */
+static void child_events_clear(int fd) {
+  struct signalfd_siginfo info;
+  while (read(fd, &info, sizeof(info)) > 0)
+    ;
+}
+
+/* Waits until every process of the job has stopped or completed */
+static void job_wait(struct job *job) {
+  if (!shell_is_interactive)
+    job_wait_pidfds(job);
+  while (!job_is_stopped(job)) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(WAIT_ANY, &status, WUNTRACED, &usage);
+    if (pid < 0 && errno == EINTR)
+      continue;
+    if (mark_process_status(pid, status, &usage) < 0)
+      break;
+  }
+}
+
+/* Takes the terminal back and puts the shell's own modes back, keeping the job's in case it is
+ * continued later */
+static void job_restore_terminal(struct job *job) {
+  if (shell_is_interactive) {
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcgetattr(shell_terminal, &job->tmodes);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+  }
+}
+
+/* Marks the job as running again */
+static void job_mark_running(struct job *job) {
+  for (size_t i = 0; i < job->length; i++)
+    job->processes[i].stopped = false;
+  job->notified = false;
+}
+
+void job_signal(struct job *job, int sig) {
+  if (job->pgid > 0) {
+    kill(-job->pgid, sig);
+    return;
+  }
+  for (size_t i = 0; i < job->length; i++)
+    if (!job->processes[i].completed)
+      kill(job->processes[i].pid, sig);
+}
+
+int job_foreground(struct job *job, bool cont) {
+  if (shell_is_interactive && job->pgid > 0)
+    tcsetpgrp(shell_terminal, job->pgid);
+  if (cont) {
+    if (shell_is_interactive)
+      tcsetattr(shell_terminal, TCSADRAIN, &job->tmodes);
+    job_mark_running(job);
+    job_signal(job, SIGCONT);
+  }
+
+  job_wait(job);
+  job_restore_terminal(job);
+  return job_status(job);
+}
+
+int job_foreground_timeout(struct job *job, uint64_t timeout_ns, uint64_t kill_after_ns) {
+  /* Processes that came without a pidfd get one here, and only those are closed after. The
+   * last slot is for a signalfd, as pidfds don't report a process stopping. */
+  struct pollfd pidfds[job->length + 1];
+  for (size_t i = 0; i < job->length; i++) {
+    pidfds[i].fd = job->processes[i].pidfd;
+    if (pidfds[i].fd < 0)
+      pidfds[i].fd = syscall(SYS_pidfd_open, job->processes[i].pid, 0);
+    pidfds[i].events = POLLIN;
+    if (pidfds[i].fd < 0) {
+      perror("shell: pidfd_open");
+      for (size_t j = 0; j < i; j++)
+        if (pidfds[j].fd != job->processes[j].pidfd)
+          close(pidfds[j].fd);
+      return job_foreground(job, false);
+    }
+  }
+  sigset_t old;
+  pidfds[job->length].fd = child_events_open(&old);
+  pidfds[job->length].events = POLLIN;
+  /* A stop from before the signalfd existed has left no signal behind, only a status */
+  job_reap();
+  if (shell_is_interactive && job->pgid > 0)
+    tcsetpgrp(shell_terminal, job->pgid);
+
+  /* Wait on the pidfds until every process has exited or the deadline passes; then ask the
+   * job to stop, and after kill_after_ns insist. A job stopped with ^Z is left stopped, as
+   * job_foreground() would leave it, and the time limit no longer applies. */
+  bool timed_out = false, stopped = false;
+  int sig = SIGTERM;
+  uint64_t deadline = clock_now_ns() + timeout_ns;
+  while (!job_is_completed(job)) {
+    if (job_is_stopped(job) && !timed_out) {
+      stopped = true;
+      break;
+    }
+    uint64_t now = clock_now_ns();
+    if (now >= deadline) {
+      if (sig == 0)
+        break;
+      timed_out = true;
+      job_signal(job, sig);
+      job_signal(job, SIGCONT);
+      deadline = now + kill_after_ns;
+      sig = sig == SIGTERM ? SIGKILL : 0;
+      continue;
+    }
+    int ms = (deadline - now + 999999) / 1000000;
+    if (poll(pidfds, job->length + (pidfds[job->length].fd >= 0), ms) > 0) {
+      if (pidfds[job->length].fd >= 0)
+        child_events_clear(pidfds[job->length].fd);
+      job_reap();
+    }
+  }
+  for (size_t i = 0; i < job->length; i++)
+    if (pidfds[i].fd != job->processes[i].pidfd)
+      close(pidfds[i].fd);
+  if (pidfds[job->length].fd >= 0)
+    child_events_close(pidfds[job->length].fd, &old);
+
+  /* Collect whatever is left, so the job doesn't linger as zombies */
+  if (!stopped)
+    job_wait(job);
+  job_restore_terminal(job);
+  return timed_out ? 124 : job_status(job);
+}
+
+int job_run(struct pipeline *pipeline, const struct spawn_attr *attr) {
+  struct job *job = job_spawn(pipeline, true, attr);
+  int status = job_foreground(job, false);
+  if (job_is_completed(job))
+    job_remove(job);
+  return status;
+}
+
+void job_background(struct job *job, bool cont) {
+  if (cont) {
+    job_mark_running(job);
+    job_signal(job, SIGCONT);
+  }
+}
+
+bool job_is_stopped(struct job *job) {
+  for (size_t i = 0; i < job->length; i++)
+    if (!job->processes[i].completed && !job->processes[i].stopped)
+      return false;
+  return true;
+}
+
+bool job_is_completed(struct job *job) {
+  for (size_t i = 0; i < job->length; i++)
+    if (!job->processes[i].completed)
+      return false;
+  return true;
+}
+
+int job_status(struct job *job) {
+  if (job->length == 0)
+    return 1;
+  int status = job->processes[job->length - 1].status;
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return 1;
+}
+
+/* Records the state of every child that has changed, without waiting */
+static void job_reap(void) {
+  int status;
+  struct rusage usage;
+  pid_t pid;
+  while ((pid = wait4(WAIT_ANY, &status, WUNTRACED | WNOHANG, &usage)) > 0)
+    mark_process_status(pid, status, &usage);
+}
+
+int job_poll_fd(struct job *job, int fd, short events) {
+  struct pollfd pfds[2] = {{fd, events, 0}, {-1, POLLIN, 0}};
+  if (poll(pfds, 1, 0) > 0)
+    return 1;
+
+  sigset_t old;
+  pfds[1].fd = child_events_open(&old);
+  int result = -1;
+  for (;;) {
+    /* A stop from before the signalfd existed has left no signal behind, only a status */
+    job_reap();
+    if (job_is_stopped(job) && !job_is_completed(job)) {
+      result = 0;
+      break;
+    }
+    int ready = poll(pfds, pfds[1].fd >= 0 ? 2 : 1, -1);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      break;
+    if (pfds[0].revents) {
+      result = 1;
+      break;
+    }
+    child_events_clear(pfds[1].fd);
+  }
+  if (pfds[1].fd >= 0)
+    child_events_close(pfds[1].fd, &old);
+  return result;
+}
+
+static void process_exited(void *data, int result) {
+  close((int) (intptr_t) data);
+  job_reap();
+}
+
+/* Has the event loop reap the job's processes as soon as they exit, through their pidfds,
+ * rather than leaving them as zombies until the next prompt */
+static void job_watch(struct job *job) {
+  for (size_t i = 0; i < job->length; i++) {
+    /* The event loop closes the descriptor it is given, so it gets its own copy */
+    int pidfd = job->processes[i].pidfd >= 0 ?
+        fcntl(job->processes[i].pidfd, F_DUPFD_CLOEXEC, 0) :
+        syscall(SYS_pidfd_open, job->processes[i].pid, 0);
+    if (pidfd < 0)
+      continue;
+    if (evloop_poll(pidfd, POLLIN, process_exited, (void *) (intptr_t) pidfd) < 0)
+      close(pidfd);
+  }
+}
+
+void job_notify(void) {
+  job_reap();
+
+  struct job *job = first_job, *next;
+  for (; job != NULL; job = next) {
+    next = job->next;
+    if (job_is_completed(job)) {
+      if (shell_is_interactive)
+        fprintf(stderr, "[%d] Done\t%s\n", job->id, job->command);
+      job_remove(job);
+    } else if (job_is_stopped(job) && !job->notified) {
+      fprintf(stderr, "[%d] Stopped\t%s\n", job->id, job->command);
+      job->notified = true;
+    }
+  }
+}
+
+void job_remove(struct job *job) {
+  struct job **link = &first_job;
+  while (*link != NULL && *link != job)
+    link = &(*link)->next;
+  if (*link == job)
+    *link = job->next;
+
+  /* The job's own cgroup goes away with it */
+  if (job->cgroup_path != NULL && rmdir(job->cgroup_path) < 0 && errno != ENOENT)
+    fprintf(stderr, "shell: %s: %s\n", job->cgroup_path, strerror(errno));
+  free(job->cgroup_path);
+
+  for (size_t i = 0; i < job->length; i++) {
+    free(job->processes[i].name);
+    if (job->processes[i].pidfd >= 0)
+      close(job->processes[i].pidfd);
+  }
+  free(job->processes);
+  free(job->command);
+  free(job);
+}
+
+/* Finds the job named by a `%N' or `N' argument, or the most recent job */
+static struct job *job_find(const char *spec) {
+  struct job *found = NULL;
+  if (spec == NULL) {
+    for (struct job *job = first_job; job != NULL; job = job->next)
+      found = job;
+    return found;
+  }
+  int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+  for (struct job *job = first_job; job != NULL; job = job->next)
+    if (job->id == id)
+      return job;
+  return NULL;
+}
+
+int cmd_jobs(struct tokens *tokens) {
+  job_notify();
+  for (struct job *job = first_job; job != NULL; job = job->next)
+    printf("[%d] %s\t%s\n", job->id, job_is_stopped(job) ? "Stopped" : "Running",
+        job->command);
+  return 0;
+}
+
+int cmd_fg(struct tokens *tokens) {
+  struct job *job = job_find(tokens_get_token(tokens, 1));
+  if (job == NULL) {
+    fprintf(stderr, "fg: no such job\n");
+    return 1;
+  }
+  printf("%s\n", job->command);
+  int status = job_foreground(job, true);
+  if (job_is_completed(job))
+    job_remove(job);
+  return status;
+}
+
+int cmd_bg(struct tokens *tokens) {
+  struct job *job = job_find(tokens_get_token(tokens, 1));
+  if (job == NULL) {
+    fprintf(stderr, "bg: no such job\n");
+    return 1;
+  }
+  printf("[%d] %s &\n", job->id, job->command);
+  job_background(job, true);
+  return 0;
+}
+
+int cmd_timeout(struct tokens *tokens) {
+  long long kill_after = 10000000000LL, timeout = -1;
+  size_t i = 1;
+  if (tokens_get_token(tokens, i) != NULL && strcmp(tokens_get_token(tokens, i), "-k") == 0) {
+    char *value = tokens_get_token(tokens, i + 1);
+    kill_after = value ? parse_duration(value) : -1;
+    i += 2;
+  }
+  if (tokens_get_token(tokens, i) != NULL)
+    timeout = parse_duration(tokens_get_token(tokens, i++));
+  if (kill_after < 0 || timeout < 0 || i >= tokens_get_length(tokens)) {
+    fprintf(stderr, "usage: timeout [-k DURATION] DURATION COMMAND...\n");
+    return 125;
+  }
+
+  struct spawn_attr attr;
+  spawn_attr_init(&attr);
+  attr.process_group = true;
+  struct pipeline *pipeline = pipeline_from_words(tokens, i);
+  struct job *job = job_spawn(pipeline, true, &attr);
+  pipeline_destroy(pipeline);
+
+  int status = job_foreground_timeout(job, timeout, kill_after);
+  if (job_is_completed(job))
+    job_remove(job);
+  return status;
+}
+
+int cmd_pipesize(struct tokens *tokens) {
+  char *value = tokens_get_token(tokens, 1);
+  if (value == NULL) {
+    if (pipe_size_default > 0)
+      printf("%lld (max %lld)\n", pipe_size_default, pipe_size_max());
+    else
+      printf("default (max %lld)\n", pipe_size_max());
+    return 0;
+  }
+
+  long long size = strcmp(value, "default") == 0 ? 0 : parse_size(value);
+  if (size < 0 || tokens_get_length(tokens) > 2) {
+    fprintf(stderr, "usage: pipesize [SIZE | default] | pipesize SIZE COMMAND [| COMMAND]...\n");
+    return 2;
+  }
+  if (size > pipe_size_max()) {
+    fprintf(stderr, "pipesize: %s: capped at %lld, the pipe-max-size\n", value, pipe_size_max());
+    size = pipe_size_max();
+  }
+  pipe_size_default = size;
+  return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "parse.h"
+#include "placement.h"
+#include "tokenizer.h"
+
+/* A process started for one stage of a job */
+struct process {
+  char *name;
+  pid_t pid;
+  /* Refers to the process for waiting on it, or -1 if the kernel couldn't provide one */
+  int pidfd;
+  int status;
+  bool completed;
+  bool stopped;
+};
+
+/* A resource limit to apply to the processes of a job */
+struct rlimit_setting {
+  int resource;
+  struct rlimit limit;
+};
+
+#define SPAWN_MAX_RLIMITS 8
+
+/* Extra setup for the processes of a job, done in each child before it runs the command */
+struct spawn_attr {
+  size_t rlimits_length;
+  struct rlimit_setting rlimits[SPAWN_MAX_RLIMITS];
+  /* Open cgroup v2 directory to start the processes in (-1 for none), and its path, which is
+   * removed once the job is done */
+  int cgroup_fd;
+  char *cgroup_path;
+  /* Start the job in its own process group even if the shell has no job control */
+  bool process_group;
+  /* CPUs and NUMA node to run on; NULL to follow the default placement policy */
+  const struct placement *placement;
+  /* Where the first process's stdin comes from instead of the shell's stdin, or -1 */
+  int stdin_fd;
+  /* Where the last process's stdout goes instead of the shell's stdout, or -1 */
+  int stdout_fd;
+};
+
+/* Sets up attributes that change nothing */
+void spawn_attr_init(struct spawn_attr *attr);
+
+/* The processes running a pipeline, kept in the job table until they are done */
+struct job {
+  struct job *next;
+  int id;
+  char *command;
+  pid_t pgid;
+  bool notified;
+  struct termios tmodes;
+  uint64_t start_ns;
+  struct rusage usage;
+  char *cgroup_path;
+  size_t length;
+  struct process *processes;
+};
+
+/* The job table, oldest job first */
+extern struct job *first_job;
+
+/* Looks up a program on PATH, returning a newly allocated path or NULL */
+char *path_resolve(const char *name);
+
+/* Points file descriptors at the files named by the command's redirections. If saved is not
+ * NULL, the replaced descriptors 0-2 are kept there for redirects_restore(). Returns -1 and
+ * prints a message if a file can't be opened. */
+int redirects_apply(struct command *command, int saved[3]);
+
+/* Puts back the descriptors saved by redirects_apply() */
+void redirects_restore(int saved[3]);
+
+/* Makes the shell ignore the job control signals; done once, when the shell starts */
+void job_control_init(void);
+
+/* Puts back the default actions of the job control signals, in a process about to become a
+ * command */
+void job_control_reset(void);
+
+/* Marks every descriptor above stderr close-on-exec, so that a command inherits 0-2 and only
+ * what is handed to it on purpose afterwards */
+void fds_close_on_exec(void);
+
+/* Forks one process per stage of the pipeline, connected by pipes, in a new process group
+ * when the shell is interactive. The job is added to the job table. attr may be NULL. */
+struct job *job_spawn(struct pipeline *pipeline, bool foreground,
+    const struct spawn_attr *attr);
+
+/* Runs the pipeline as a foreground job and returns its exit status */
+int job_run(struct pipeline *pipeline, const struct spawn_attr *attr);
+
+/* Gives the job the terminal (continuing it first if cont is set) and waits until it stops or
+ * completes, then takes the terminal back. Returns the job's exit status. */
+int job_foreground(struct job *job, bool cont);
+
+/* Like job_foreground(), but after timeout_ns the job's process group is sent SIGTERM, and
+ * SIGKILL if it is still there kill_after_ns later. Returns 124 if the job timed out. */
+int job_foreground_timeout(struct job *job, uint64_t timeout_ns, uint64_t kill_after_ns);
+
+/* Waits until fd is ready for events, or until the job stops: a job filling a pipe can be
+ * stopped with ^Z without closing it, which would leave a plain read() blocked for good.
+ * Returns 1 if fd is ready, 0 if the job has stopped, -1 on error. */
+int job_poll_fd(struct job *job, int fd, short events);
+
+/* Lets the job run without the terminal, continuing it first if cont is set */
+void job_background(struct job *job, bool cont);
+
+bool job_is_stopped(struct job *job);
+bool job_is_completed(struct job *job);
+
+/* Exit status of a job: that of its last process, or 128 + the signal that stopped it */
+int job_status(struct job *job);
+
+/* Sends a signal to every process of the job */
+void job_signal(struct job *job, int sig);
+
+/* Reaps any children that changed state, reports stopped and finished background jobs and
+ * drops finished ones from the job table */
+void job_notify(void);
+
+/* Takes a job out of the job table and frees it */
+void job_remove(struct job *job);
+
+/* Built-ins: list jobs, and move a job to the foreground or background */
+int cmd_jobs(struct tokens *tokens);
+int cmd_fg(struct tokens *tokens);
+int cmd_bg(struct tokens *tokens);
+
+/* Built-in: `timeout [-k DURATION] DURATION COMMAND...' runs COMMAND, sending its process
+ * group SIGTERM once DURATION has passed and SIGKILL after the -k grace period (10s) */
+int cmd_timeout(struct tokens *tokens);
+
+/* Built-in: `pipesize [SIZE | default]' prints or sets the capacity given to the pipes between
+ * the commands of a pipeline; `pipesize SIZE' in front of a pipeline sets it for that one only.
+ * Sizes are capped at /proc/sys/fs/pipe-max-size. */
+int cmd_pipesize(struct tokens *tokens);
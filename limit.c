@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "limit.h"
+#include "parse.h"
+
+#define MAX_CGROUP_SETTINGS 16
+
+/* Finds the directory of the shell's own cgroup v2 group, and whether it is the root; returns
+ * a newly allocated path or NULL */
+static char *cgroup_self(bool *root) {
+  char *mount = NULL;
+  FILE *mounts = setmntent("/proc/self/mounts", "r");
+  struct mntent *entry;
+  while (mounts != NULL && (entry = getmntent(mounts)) != NULL) {
+    if (strcmp(entry->mnt_type, "cgroup2") == 0) {
+      mount = strdup(entry->mnt_dir);
+      break;
+    }
+  }
+  if (mounts != NULL)
+    endmntent(mounts);
+  if (mount == NULL)
+    return NULL;
+
+  char line[4096], *path = NULL;
+  FILE *cgroups = fopen("/proc/self/cgroup", "r");
+  while (cgroups != NULL && fgets(line, sizeof(line), cgroups)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      *root = strcmp(line + 3, "/") == 0;
+      path = (char *) malloc(strlen(mount) + strlen(line + 3) + 1);
+      strcpy(path, mount);
+      strcat(path, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+      break;
+    }
+  }
+  if (cgroups != NULL)
+    fclose(cgroups);
+  free(mount);
+  return path;
+}
+
+static int write_file(int dir, const char *name, const char *value) {
+  int fd = openat(dir, name, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = write(fd, value, strlen(value));
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return n == (ssize_t) strlen(value) ? 0 : -1;
+}
+
+/* Enables a controller for the children of the shell's group, parent_fd. Outside the root, a
+ * group with processes of its own can't do that, so if the shell's group refuses the shell
+ * first moves itself into a leaf child of it (which it stays in) and tries again. */
+static int controller_enable(int parent_fd, bool root, const char *controller) {
+  static bool moved;
+  if (write_file(parent_fd, "cgroup.subtree_control", controller) == 0)
+    return 0;
+  if (errno != EBUSY || root || moved)
+    return -1;
+
+  char leaf[32], pid[16];
+  snprintf(leaf, sizeof(leaf), "shell-%d", (int) getpid());
+  snprintf(pid, sizeof(pid), "%d", (int) getpid());
+  int leaf_fd = mkdirat(parent_fd, leaf, 0755) == 0 || errno == EEXIST ?
+      openat(parent_fd, leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  int result = leaf_fd >= 0 ? write_file(leaf_fd, "cgroup.procs", pid) : -1;
+  int saved = errno;
+  if (leaf_fd >= 0)
+    close(leaf_fd);
+  errno = saved;
+  if (result < 0)
+    return -1;
+  moved = true;
+  /* Anything else still in the group (the shell's parent, say) keeps it busy */
+  return write_file(parent_fd, "cgroup.subtree_control", controller);
+}
+
+/* Creates a child of the shell's cgroup with the given control file settings (FILE=VALUE) and
+ * opens it into attr. Returns -1 and prints a message on failure. */
+static int cgroup_create(struct spawn_attr *attr, char **settings, size_t length) {
+  static int counter;
+  /* Once the shell has moved into a leaf, its group is that leaf's parent */
+  static char *base;
+  static bool base_root;
+  if (base == NULL)
+    base = cgroup_self(&base_root);
+  char *parent = base ? strdup(base) : NULL;
+  if (parent == NULL) {
+    fprintf(stderr, "limit: no cgroup v2 hierarchy is mounted\n");
+    return -1;
+  }
+  int parent_fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  char name[64];
+  snprintf(name, sizeof(name), "shell-%d-%d", (int) getpid(), ++counter);
+  attr->cgroup_path = (char *) malloc(strlen(parent) + strlen(name) + 2);
+  sprintf(attr->cgroup_path, "%s/%s", parent, name);
+  free(parent);
+
+  if (parent_fd < 0 || mkdirat(parent_fd, name, 0755) < 0) {
+    fprintf(stderr, "limit: %s: %s\n", attr->cgroup_path, strerror(errno));
+    goto fail;
+  }
+  attr->cgroup_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (attr->cgroup_fd < 0) {
+    fprintf(stderr, "limit: %s: %s\n", attr->cgroup_path, strerror(errno));
+    goto fail;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    char *equals = strchr(settings[i], '=');
+    char file[256], controller[256];
+    snprintf(file, sizeof(file), "%.*s", (int) (equals - settings[i]), settings[i]);
+    snprintf(controller, sizeof(controller), "+%.*s", (int) strcspn(file, "."), file);
+
+    /* The controller has to be enabled for the parent's children; it may already be. The
+     * cgroup.* files are the core's own. */
+    if (strcmp(controller, "+cgroup") != 0 &&
+        controller_enable(parent_fd, base_root, controller) < 0) {
+      fprintf(stderr, "limit: %s/cgroup.subtree_control: %s: %s\n", base, controller,
+          strerror(errno));
+      goto fail;
+    }
+    if (write_file(attr->cgroup_fd, file, equals + 1) < 0) {
+      fprintf(stderr, "limit: %s: %s\n", file, strerror(errno));
+      goto fail;
+    }
+  }
+  close(parent_fd);
+  return 0;
+
+fail:
+  if (attr->cgroup_fd >= 0)
+    close(attr->cgroup_fd);
+  attr->cgroup_fd = -1;
+  unlinkat(parent_fd, name, AT_REMOVEDIR);
+  if (parent_fd >= 0)
+    close(parent_fd);
+  free(attr->cgroup_path);
+  attr->cgroup_path = NULL;
+  return -1;
+}
+
+static int add_rlimit(struct spawn_attr *attr, int resource, const char *value) {
+  struct rlimit_setting *setting = &attr->rlimits[attr->rlimits_length];
+  long long limit = strcmp(value, "unlimited") == 0 ? (long long) RLIM_INFINITY :
+      parse_size(value);
+  if (limit < 0 || attr->rlimits_length == SPAWN_MAX_RLIMITS) {
+    fprintf(stderr, "limit: invalid limit: %s\n", value);
+    return -1;
+  }
+  setting->resource = resource;
+  setting->limit.rlim_cur = setting->limit.rlim_max = limit;
+  attr->rlimits_length++;
+  return 0;
+}
+
+int cmd_limit(struct tokens *tokens) {
+  struct spawn_attr attr;
+  spawn_attr_init(&attr);
+  char *settings[MAX_CGROUP_SETTINGS];
+  size_t settings_length = 0;
+
+  size_t i = 1;
+  for (; i + 1 < tokens_get_length(tokens); i += 2) {
+    char *option = tokens_get_token(tokens, i), *value = tokens_get_token(tokens, i + 1);
+    int result = 0;
+    if (strcmp(option, "-t") == 0) {
+      result = add_rlimit(&attr, RLIMIT_CPU, value);
+    } else if (strcmp(option, "-m") == 0) {
+      result = add_rlimit(&attr, RLIMIT_AS, value);
+    } else if (strcmp(option, "-n") == 0) {
+      result = add_rlimit(&attr, RLIMIT_NOFILE, value);
+    } else if (strcmp(option, "-g") == 0) {
+      if (strchr(value, '=') == NULL || settings_length == MAX_CGROUP_SETTINGS) {
+        fprintf(stderr, "limit: expected FILE=VALUE: %s\n", value);
+        return 1;
+      }
+      settings[settings_length++] = value;
+    } else {
+      break;
+    }
+    if (result < 0)
+      return 1;
+  }
+
+  if (i >= tokens_get_length(tokens)) {
+    fprintf(stderr, "usage: limit [-t SECONDS] [-m BYTES] [-n FILES] [-g FILE=VALUE]... "
+        "COMMAND...\n");
+    return 1;
+  }
+  if (settings_length > 0 && cgroup_create(&attr, settings, settings_length) < 0)
+    return 1;
+
+  struct pipeline *pipeline = pipeline_from_words(tokens, i);
+  int status = job_run(pipeline, &attr);
+  pipeline_destroy(pipeline);
+  if (attr.cgroup_fd >= 0)
+    close(attr.cgroup_fd);
+  free(attr.cgroup_path);
+  return status;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Built-in: `limit [-t SECONDS] [-m BYTES] [-n FILES] [-g FILE=VALUE]... COMMAND...' runs
+ * COMMAND with resource limits. -t, -m and -n set RLIMIT_CPU, RLIMIT_AS and RLIMIT_NOFILE;
+ * each -g writes a cgroup v2 control file (cpu.max, memory.max, io.max, ...) of a fresh child
+ * cgroup that the command is started in. */
+int cmd_limit(struct tokens *tokens);
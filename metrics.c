@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "metrics.h"
+#include "timing.h"
+
+/* Histograms are log-linear, as in HdrHistogram: each power of two is split into
+ * 2^SUB_BUCKET_BITS equal buckets, so any value is counted within 1/8 (12.5%) of itself. */
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+struct histogram {
+  char *command;
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t counts[BUCKETS];
+};
+
+static struct histogram **histograms;
+static size_t histograms_length;
+
+static char *export_path;
+/* The shell that set up the export; a forked child has only a stale copy of the histograms */
+static pid_t export_pid;
+static uint64_t export_interval_ns;
+static uint64_t export_last_ns;
+static int export_timer_armed;
+
+/* Upper bounds of the Prometheus buckets, in seconds */
+static const double bounds[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+  2.5, 5, 10, 30, 60, 300,
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static size_t bucket_index(uint64_t ns) {
+  if (ns < SUB_BUCKETS)
+    return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - SUB_BUCKET_BITS;
+  return ((size_t) (shift + 1) << SUB_BUCKET_BITS) + ((ns >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value counted in a bucket */
+static uint64_t bucket_upper(size_t index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  int shift = (index >> SUB_BUCKET_BITS) - 1;
+  uint64_t base = (uint64_t) (SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+  return base + ((uint64_t) 1 << shift) - 1;
+}
+
+static struct histogram *histogram_get(const char *command) {
+  for (size_t i = 0; i < histograms_length; i++)
+    if (strcmp(histograms[i]->command, command) == 0)
+      return histograms[i];
+
+  struct histogram *histogram = (struct histogram *) calloc(1, sizeof(struct histogram));
+  histogram->command = strdup(command);
+  histograms = (struct histogram **) realloc(histograms,
+      sizeof(struct histogram *) * (histograms_length + 1));
+  histograms[histograms_length++] = histogram;
+  return histogram;
+}
+
+void metrics_record(const char *command, uint64_t ns) {
+  if (command == NULL)
+    return;
+  struct histogram *histogram = histogram_get(command);
+  histogram->count++;
+  histogram->sum_ns += ns;
+  histogram->counts[bucket_index(ns)]++;
+  metrics_flush(0);
+}
+
+/* Prints a command name as a label value, escaped as the text format requires */
+static void write_label(FILE *out, const char *command) {
+  for (const char *c = command; *c; c++) {
+    if (*c == '\\' || *c == '"')
+      fprintf(out, "\\%c", *c);
+    else if (*c == '\n')
+      fputs("\\n", out);
+    else
+      fputc(*c, out);
+  }
+}
+
+static uint64_t histogram_quantile(struct histogram *histogram, double quantile) {
+  uint64_t rank = (uint64_t) (quantile * histogram->count + 0.5), seen = 0;
+  if (rank == 0)
+    rank = 1;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank)
+      return bucket_upper(i);
+  }
+  return 0;
+}
+
+void metrics_write(FILE *out) {
+  fputs("# HELP shell_command_duration_seconds Time taken by commands run from the shell.\n"
+      "# TYPE shell_command_duration_seconds histogram\n", out);
+  for (size_t i = 0; i < histograms_length; i++) {
+    struct histogram *histogram = histograms[i];
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+      uint64_t bound_ns = (uint64_t) (bounds[b] * 1e9);
+      while (bucket < BUCKETS && bucket_upper(bucket) <= bound_ns)
+        cumulative += histogram->counts[bucket++];
+      fputs("shell_command_duration_seconds_bucket{command=\"", out);
+      write_label(out, histogram->command);
+      fprintf(out, "\",le=\"%g\"} %llu\n", bounds[b], (unsigned long long) cumulative);
+    }
+    fputs("shell_command_duration_seconds_bucket{command=\"", out);
+    write_label(out, histogram->command);
+    fprintf(out, "\",le=\"+Inf\"} %llu\n", (unsigned long long) histogram->count);
+    fputs("shell_command_duration_seconds_sum{command=\"", out);
+    write_label(out, histogram->command);
+    fprintf(out, "\"} %.9f\n", histogram->sum_ns / 1e9);
+    fputs("shell_command_duration_seconds_count{command=\"", out);
+    write_label(out, histogram->command);
+    fprintf(out, "\"} %llu\n", (unsigned long long) histogram->count);
+  }
+
+  fputs("# HELP shell_command_duration_quantile_seconds Command time quantiles, within 12.5%.\n"
+      "# TYPE shell_command_duration_quantile_seconds gauge\n", out);
+  for (size_t i = 0; i < histograms_length; i++) {
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      fputs("shell_command_duration_quantile_seconds{command=\"", out);
+      write_label(out, histograms[i]->command);
+      fprintf(out, "\",quantile=\"%g\"} %.9f\n", quantiles[q],
+          histogram_quantile(histograms[i], quantiles[q]) / 1e9);
+    }
+  }
+}
+
+static void export_timer_expired(void *data, int result) {
+  export_timer_armed = 0;
+  metrics_flush(1);
+}
+
+void metrics_flush(int force) {
+  if (export_path == NULL || getpid() != export_pid)
+    return;
+  uint64_t now = clock_now_ns();
+  if (!force && now - export_last_ns < export_interval_ns) {
+    /* Too soon; write the new numbers when the interval is up, even if the shell is idle */
+    if (!export_timer_armed && evloop_timeout(export_last_ns + export_interval_ns - now,
+        export_timer_expired, NULL) == 0)
+      export_timer_armed = 1;
+    return;
+  }
+  export_last_ns = now;
+
+  /* Write a fresh file and rename it into place, so scrapers never see a partial one */
+  size_t length = strlen(export_path) + 32;
+  char tmp[length];
+  snprintf(tmp, length, "%s.%d.tmp", export_path, (int) getpid());
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    perror("shell: metrics");
+    return;
+  }
+  metrics_write(out);
+  if (fclose(out) != 0 || rename(tmp, export_path) != 0) {
+    perror("shell: metrics");
+    unlink(tmp);
+  }
+}
+
+static void metrics_flush_at_exit(void) {
+  metrics_flush(1);
+}
+
+int cmd_metrics(struct tokens *tokens) {
+  char *path = tokens_get_token(tokens, 1);
+  if (path == NULL) {
+    metrics_write(stdout);
+    return 0;
+  }
+
+  free(export_path);
+  export_path = NULL;
+  if (strcmp(path, "off") == 0)
+    return 0;
+
+  char *seconds = tokens_get_token(tokens, 2);
+  double interval = seconds ? atof(seconds) : 10;
+  if (interval <= 0) {
+    fprintf(stderr, "metrics: invalid interval: %s\n", seconds);
+    return 1;
+  }
+
+  static int registered;
+  if (!registered++)
+    atexit(metrics_flush_at_exit);
+  export_path = strdup(path);
+  export_pid = getpid();
+  export_interval_ns = (uint64_t) (interval * 1e9);
+  metrics_flush(1);
+  return 0;
+}
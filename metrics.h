@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tokenizer.h"
+
+/* Records that the named command took the given number of nanoseconds */
+void metrics_record(const char *command, uint64_t ns);
+
+/* Writes every histogram in the Prometheus text format */
+void metrics_write(FILE *out);
+
+/* Rewrites the export file if one is set up and it is older than the export interval */
+void metrics_flush(int force);
+
+/* Built-in: `metrics' prints the histograms, `metrics FILE [SECONDS]' keeps FILE up to date,
+ * `metrics off' stops doing so */
+int cmd_metrics(struct tokens *tokens);
@@ -0,0 +1,421 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "parse.h"
+
+static void syntax_error(const char *near) {
+  fprintf(stderr, "shell: syntax error near `%s'\n", near ? near : "newline");
+}
+
+static struct command *add_command(struct pipeline *pipeline) {
+  pipeline->commands = (struct command *) realloc(pipeline->commands,
+      sizeof(struct command) * (pipeline->length + 1));
+  struct command *command = &pipeline->commands[pipeline->length++];
+  command->assignments_length = 0;
+  command->assignments = NULL;
+  command->words = tokens_new();
+  command->redirects_length = 0;
+  command->redirects = NULL;
+  command->substitutions_length = 0;
+  command->substitutions = NULL;
+  command->subshell = NULL;
+  return command;
+}
+
+static bool command_is_empty(struct command *command) {
+  return tokens_get_length(command->words) == 0 && command->assignments_length == 0 &&
+      command->redirects_length == 0;
+}
+
+static void add_redirect(struct command *command, int fd, int flags, const char *path) {
+  command->redirects = (struct redirect *) realloc(command->redirects,
+      sizeof(struct redirect) * (command->redirects_length + 1));
+  struct redirect *redirect = &command->redirects[command->redirects_length++];
+  redirect->fd = fd;
+  redirect->flags = flags;
+  redirect->path = strdup(path);
+}
+
+bool is_name(const char *text, size_t length) {
+  if (length == 0 || !(isalpha((unsigned char) text[0]) || text[0] == '_'))
+    return false;
+  for (size_t i = 1; i < length; i++)
+    if (!(isalnum((unsigned char) text[i]) || text[i] == '_'))
+      return false;
+  return true;
+}
+
+/* The parser's place in the words of a line */
+struct parser {
+  struct tokens *tokens;
+  size_t i;
+};
+
+static char *peek(struct parser *parser) {
+  return tokens_get_token(parser->tokens, parser->i);
+}
+
+static bool at(struct parser *parser, const char *operator) {
+  return tokens_match(parser->tokens, parser->i, operator);
+}
+
+/* Is the current word the given reserved word, rather than an operator or quoted text? */
+static bool at_word(struct parser *parser, const char *word) {
+  return peek(parser) != NULL && !tokens_is_operator(parser->tokens, parser->i) &&
+      strcmp(peek(parser), word) == 0;
+}
+
+/* Does the current pipeline end here? */
+static bool at_pipeline_end(struct parser *parser) {
+  return peek(parser) == NULL || at(parser, ";") || at(parser, "&") || at(parser, "&&") ||
+      at(parser, "||") || at(parser, ")");
+}
+
+/* Joins words from up to end (exclusive) back into text, without spaces inside parentheses */
+static char *tokens_text(struct tokens *tokens, size_t from, size_t end) {
+  size_t size = 1;
+  for (size_t i = from; i < end; i++)
+    size += strlen(tokens_get_token(tokens, i)) + 1;
+  char *text = (char *) malloc(size);
+  text[0] = '\0';
+  for (size_t i = from; i < end; i++) {
+    char *word = tokens_get_token(tokens, i);
+    size_t length = strlen(text);
+    bool opened = length > 0 && text[length - 1] == '(' && tokens_is_operator(tokens, i - 1);
+    if (i > from && !opened && !tokens_match(tokens, i, ")"))
+      strcat(text, " ");
+    strcat(text, word);
+  }
+  return text;
+}
+
+static struct list *parse_list_at(struct parser *parser, bool nested);
+
+/* If the current word is an assignment, adds it to command and moves past it; returns 0 if it
+ * isn't one, 1 if it is and -1 on syntax errors */
+static int parse_assignment(struct parser *parser, struct command *command) {
+  struct tokens *tokens = parser->tokens;
+  char *word = peek(parser);
+  if (tokens_is_operator(tokens, parser->i))
+    return 0;
+  size_t name_length = 0;
+  while (isalnum((unsigned char) word[name_length]) || word[name_length] == '_')
+    name_length++;
+  if (!is_name(word, name_length))
+    return 0;
+  char *bracket = word[name_length] == '[' ? word + name_length : NULL;
+  char *equals = bracket ? strstr(bracket, "]=") : word + name_length;
+  if (equals == NULL)
+    return 0;
+  equals += bracket ? 1 : 0;
+  if (*equals != '=')
+    return 0;
+
+  command->assignments = (struct assignment *) realloc(command->assignments,
+      sizeof(struct assignment) * (command->assignments_length + 1));
+  struct assignment *assignment = &command->assignments[command->assignments_length++];
+  assignment->name = strndup(word, name_length);
+  assignment->key = bracket ? strndup(bracket + 1, equals - bracket - 2) : NULL;
+  assignment->values = tokens_new();
+  assignment->array = bracket == NULL && equals[1] == '\0' &&
+      tokens_match(tokens, parser->i + 1, "(");
+  parser->i++;
+  if (!assignment->array) {
+    tokens_append(assignment->values, equals + 1, false);
+    return 1;
+  }
+
+  /* NAME=( starts an array, which runs up to the closing `)' */
+  for (parser->i++; peek(parser) != NULL && !tokens_is_operator(tokens, parser->i); parser->i++)
+    tokens_append(assignment->values, peek(parser), false);
+  if (!at(parser, ")")) {
+    syntax_error(peek(parser));
+    return -1;
+  }
+  parser->i++;
+  return 1;
+}
+
+/* Parses the list up to a closing `)', which it moves past; returns NULL on syntax errors */
+static struct list *parse_parenthesized(struct parser *parser) {
+  size_t start = parser->i++;
+  struct list *list = parse_list_at(parser, true);
+  if (list == NULL)
+    return NULL;
+  if (list->length == 0 || !at(parser, ")")) {
+    syntax_error(peek(parser));
+    list_destroy(list);
+    return NULL;
+  }
+  parser->i++;
+  list->text = tokens_text(parser->tokens, start, parser->i);
+  return list;
+}
+
+/* Parses the process substitution at the current word into a new word of command */
+static bool parse_substitution(struct parser *parser, struct command *command) {
+  bool output = at(parser, ">(");
+  struct list *list = parse_parenthesized(parser);
+  if (list == NULL)
+    return false;
+
+  command->substitutions = (struct substitution *) realloc(command->substitutions,
+      sizeof(struct substitution) * (command->substitutions_length + 1));
+  struct substitution *substitution = &command->substitutions[command->substitutions_length++];
+  substitution->word = tokens_get_length(command->words);
+  substitution->output = output;
+  substitution->list = list;
+  /* The word stands for the substitution in job listings until it is replaced at spawn time */
+  tokens_append(command->words, list->text, false);
+  return true;
+}
+
+/* Parses a redirection operator and its path */
+static bool parse_redirect(struct parser *parser, struct command *command) {
+  char *word = peek(parser);
+  parser->i++;
+  char *path = peek(parser);
+  if (path == NULL || tokens_is_operator(parser->tokens, parser->i)) {
+    syntax_error(path);
+    return false;
+  }
+  if (strcmp(word, "<") == 0)
+    add_redirect(command, 0, O_RDONLY, path);
+  else if (strcmp(word, ">") == 0)
+    add_redirect(command, 1, O_WRONLY | O_CREAT | O_TRUNC, path);
+  else
+    add_redirect(command, 1, O_WRONLY | O_CREAT | O_APPEND, path);
+  parser->i++;
+  return true;
+}
+
+static bool at_redirect(struct parser *parser) {
+  return at(parser, "<") || at(parser, ">") || at(parser, ">>");
+}
+
+/* Parses one command of a pipeline, stopping at the first word that doesn't belong to it */
+static bool parse_command(struct parser *parser, struct command *command) {
+  if (at(parser, "(")) {
+    if ((command->subshell = parse_parenthesized(parser)) == NULL)
+      return false;
+    while (at_redirect(parser))
+      if (!parse_redirect(parser, command))
+        return false;
+    if (!at_pipeline_end(parser) && !at(parser, "|")) {
+      syntax_error(peek(parser));
+      return false;
+    }
+    return true;
+  }
+
+  while (peek(parser) != NULL) {
+    int assignment = tokens_get_length(command->words) == 0 ?
+        parse_assignment(parser, command) : 0;
+    if (assignment < 0)
+      return false;
+    if (assignment > 0)
+      continue;
+    if (!tokens_is_operator(parser->tokens, parser->i)) {
+      tokens_append(command->words, peek(parser), false);
+      parser->i++;
+    } else if (at(parser, "<(") || at(parser, ">(")) {
+      if (!parse_substitution(parser, command))
+        return false;
+    } else if (at_redirect(parser)) {
+      if (!parse_redirect(parser, command))
+        return false;
+    } else {
+      break;
+    }
+  }
+
+  if (command_is_empty(command)) {
+    syntax_error(peek(parser));
+    return false;
+  }
+  return true;
+}
+
+/* Parses the options of the `time' reserved word */
+static void parse_time(struct parser *parser, struct pipeline *pipeline) {
+  pipeline->flags |= PIPELINE_TIME;
+  for (parser->i++; peek(parser) != NULL && !tokens_is_operator(parser->tokens, parser->i);
+      parser->i++) {
+    char *word = peek(parser);
+    if (strcmp(word, "-j") == 0 || strcmp(word, "--json") == 0)
+      pipeline->flags |= PIPELINE_TIME_JSON;
+    else
+      break;
+  }
+}
+
+/* `pipesize SIZE' is a reserved word only when a pipeline follows it; otherwise it is the
+ * built-in that sets the default. Returns whether it was taken as one. */
+static bool parse_pipesize(struct parser *parser, struct pipeline *pipeline) {
+  struct parser after = {parser->tokens, parser->i + 1};
+  if (peek(&after) == NULL || tokens_is_operator(after.tokens, after.i))
+    return false;
+  long long size = parse_size(peek(&after));
+  after.i++;
+  if (size <= 0 || at_pipeline_end(&after) || at(&after, "|"))
+    return false;
+  pipeline->pipe_size = size;
+  parser->i = after.i;
+  return true;
+}
+
+static struct pipeline *parse_pipeline(struct parser *parser) {
+  struct pipeline *pipeline = (struct pipeline *) calloc(1, sizeof(struct pipeline));
+  for (;;) {
+    if (!(pipeline->flags & PIPELINE_TIME) && at_word(parser, "time"))
+      parse_time(parser, pipeline);
+    else if (pipeline->pipe_size != 0 || !at_word(parser, "pipesize") ||
+        !parse_pipesize(parser, pipeline))
+      break;
+  }
+  if ((pipeline->flags & PIPELINE_TIME) && at_pipeline_end(parser))
+    return pipeline;
+
+  for (;;) {
+    if (!parse_command(parser, add_command(pipeline))) {
+      pipeline_destroy(pipeline);
+      return NULL;
+    }
+    if (!at(parser, "|"))
+      return pipeline;
+    parser->i++;
+  }
+}
+
+/* Parses pipelines and their connectors, up to the end of the words or, if nested, a `)' */
+static struct list *parse_list_at(struct parser *parser, bool nested) {
+  struct list *list = (struct list *) calloc(1, sizeof(struct list));
+  while (peek(parser) != NULL && !(nested && at(parser, ")"))) {
+    struct pipeline *pipeline = parse_pipeline(parser);
+    if (pipeline == NULL) {
+      list_destroy(list);
+      return NULL;
+    }
+    list->items = (struct list_item *) realloc(list->items,
+        sizeof(struct list_item) * (list->length + 1));
+    struct list_item *item = &list->items[list->length++];
+    item->pipeline = pipeline;
+    item->connector = LIST_SEQUENCE;
+
+    if (at(parser, "&"))
+      pipeline->flags |= PIPELINE_BACKGROUND;
+    else if (at(parser, "&&"))
+      item->connector = LIST_AND;
+    else if (at(parser, "||"))
+      item->connector = LIST_OR;
+    else if (!at(parser, ";"))
+      continue;
+    parser->i++;
+
+    /* `&&' and `||' need something after them */
+    if (item->connector != LIST_SEQUENCE && (peek(parser) == NULL || at(parser, ")"))) {
+      syntax_error(peek(parser));
+      list_destroy(list);
+      return NULL;
+    }
+  }
+  return list;
+}
+
+struct list *parse_list(struct tokens *tokens) {
+  struct parser parser = {tokens, 0};
+  struct list *list = parse_list_at(&parser, false);
+  if (list != NULL && peek(&parser) != NULL) {
+    syntax_error(peek(&parser));
+    list_destroy(list);
+    return NULL;
+  }
+  return list;
+}
+
+struct pipeline *pipeline_from_words(struct tokens *tokens, size_t start) {
+  struct pipeline *pipeline = (struct pipeline *) calloc(1, sizeof(struct pipeline));
+  if (start >= tokens_get_length(tokens))
+    return pipeline;
+  struct command *command = add_command(pipeline);
+  for (size_t i = start; i < tokens_get_length(tokens); i++)
+    tokens_append(command->words, tokens_get_token(tokens, i), false);
+  return pipeline;
+}
+
+long long parse_size(const char *text) {
+  char *end;
+  errno = 0;
+  long long size = strtoll(text, &end, 10);
+  if (errno != 0 || end == text || size < 0)
+    return -1;
+  int shift = 0;
+  switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+  }
+  if (*end != '\0' || size > (LLONG_MAX >> shift))
+    return -1;
+  return size << shift;
+}
+
+long long parse_duration(const char *text) {
+  static const struct {
+    const char *suffix;
+    double scale;
+  } units[] = {
+    {"", 1e9}, {"s", 1e9}, {"ms", 1e6}, {"us", 1e3}, {"ns", 1}, {"m", 60e9}, {"h", 3600e9},
+  };
+  char *end;
+  errno = 0;
+  double value = strtod(text, &end);
+  if (errno != 0 || end == text || value < 0)
+    return -1;
+  for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+    if (strcmp(end, units[i].suffix) == 0 && value * units[i].scale < 9e18)
+      return (long long) (value * units[i].scale);
+  return -1;
+}
+
+void pipeline_destroy(struct pipeline *pipeline) {
+  if (pipeline == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < pipeline->length; i++) {
+    struct command *command = &pipeline->commands[i];
+    for (size_t j = 0; j < command->assignments_length; j++) {
+      free(command->assignments[j].name);
+      free(command->assignments[j].key);
+      tokens_destroy(command->assignments[j].values);
+    }
+    free(command->assignments);
+    tokens_destroy(command->words);
+    for (size_t j = 0; j < command->redirects_length; j++)
+      free(command->redirects[j].path);
+    free(command->redirects);
+    for (size_t j = 0; j < command->substitutions_length; j++)
+      list_destroy(command->substitutions[j].list);
+    free(command->substitutions);
+    list_destroy(command->subshell);
+  }
+  free(pipeline->commands);
+  free(pipeline);
+}
+
+void list_destroy(struct list *list) {
+  if (list == NULL)
+    return;
+  for (size_t i = 0; i < list->length; i++)
+    pipeline_destroy(list->items[i].pipeline);
+  free(list->items);
+  free(list->text);
+  free(list);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "tokenizer.h"
+
+/* A redirection of one of a command's file descriptors to a file */
+struct redirect {
+  int fd;
+  int flags;
+  char *path;
+};
+
+struct list;
+
+/* A process substitution, `<(list)' or `>(list)': word number word of the command is replaced
+ * by a /dev/fd path to a pipe that the list writes to (or, for `>(', reads from) */
+struct substitution {
+  size_t word;
+  bool output;
+  struct list *list;
+};
+
+/* A variable assignment: NAME=VALUE, NAME[KEY]=VALUE, or NAME=(VALUE...) for an array, whose
+ * values can be [KEY]=VALUE. Keys and values are expanded when it is carried out. */
+struct assignment {
+  char *name;
+  char *key;
+  bool array;
+  struct tokens *values;
+};
+
+/* A single command: the assignments before it, its words and the redirections applied before
+ * it runs. A subshell, `( list )', has a list instead of words. */
+struct command {
+  size_t assignments_length;
+  struct assignment *assignments;
+  struct tokens *words;
+  size_t redirects_length;
+  struct redirect *redirects;
+  size_t substitutions_length;
+  struct substitution *substitutions;
+  struct list *subshell;
+};
+
+/* Report how long the pipeline took once it is done */
+#define PIPELINE_TIME 0x1
+/* ... as a JSON object instead of plain text */
+#define PIPELINE_TIME_JSON 0x2
+/* Run it as a background job (`&') */
+#define PIPELINE_BACKGROUND 0x4
+
+/* Commands connected by pipes, each one's stdout feeding the next one's stdin */
+struct pipeline {
+  int flags;
+  /* Capacity to ask for on the pipes between the commands (`pipesize SIZE'), or 0 for the
+   * default */
+  long long pipe_size;
+  size_t length;
+  struct command *commands;
+};
+
+/* How a pipeline in a list leads to the next one: `;' (or `&') always runs it, `&&' only if
+ * this one succeeded and `||' only if it failed */
+#define LIST_SEQUENCE 0
+#define LIST_AND 1
+#define LIST_OR 2
+
+struct list_item {
+  struct pipeline *pipeline;
+  int connector;
+};
+
+/* Pipelines run one after another, with the text they were parsed from for job listings */
+struct list {
+  size_t length;
+  struct list_item *items;
+  char *text;
+};
+
+/* Turn a line of words into a list; prints a message and returns NULL on syntax errors */
+struct list *parse_list(struct tokens *tokens);
+
+/* Make a pipeline of a single command from the words of tokens starting at start, as used by
+ * built-ins that run another command */
+struct pipeline *pipeline_from_words(struct tokens *tokens, size_t start);
+
+/* Is text (of the given length) a variable name: a letter or underscore, then letters, digits
+ * and underscores? */
+bool is_name(const char *text, size_t length);
+
+/* Parses a size such as 4096, 64K, 512M or 2G; returns -1 if it isn't one */
+long long parse_size(const char *text);
+
+/* Parses a duration in nanoseconds such as 10 (seconds), 1.5s, 250ms, 100us, 2m or 1h;
+ * returns -1 if it isn't one */
+long long parse_duration(const char *text);
+
+/* Free the memory */
+void pipeline_destroy(struct pipeline *pipeline);
+
+/* Free the memory */
+void list_destroy(struct list *list);
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Profile-guided optimization training run: feeds a tokenizer corpus and a representative
+# script through the shell given as $1 (default ./shell).
+#
+#   pgo/train.sh ./shell [ROUNDS]
+
+SHELL_BIN=${1:-./shell}
+ROUNDS=${2:-2000}
+
+workload() {
+  i=0
+  while [ $i -lt "$ROUNDS" ]; do
+    # Tokenizer corpus: plain words, quoting, escapes and operators, given to a builtin so
+    # that nothing is forked
+    echo '? plain words with several arguments and --long-options=value > /dev/null'
+    echo "? 'single quoted \\' text' \"double quoted 'text'\" back\\ slash > /dev/null"
+    echo '? "quoted | pipe" '"'"'quoted > redirect'"'"' </dev/null >/dev/null >>/dev/null'
+    echo "? $i mixed\"quo\"ted'wo'rds and\\ escaped\\ spaces > /dev/null"
+    # Builtins, pipelines and redirections
+    echo '? > /dev/null'
+    echo 'time -j ? > /dev/null'
+    if [ $((i % 50)) -eq 0 ]; then
+      echo 'echo pgo training | tr a-z A-Z | cat > /dev/null'
+      echo 'cat < /dev/null | wc -c > /dev/null'
+      echo 'metrics > /dev/null'
+    fi
+    i=$((i + 1))
+  done
+}
+
+workload | "$SHELL_BIN" > /dev/null 2>&1
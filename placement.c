@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "placement.h"
+
+#define MAX_NODES 64
+
+struct placement {
+  cpu_set_t cpus;
+  /* NUMA node to take memory from, or -1 to leave memory policy alone */
+  int node;
+};
+
+/* One placement per NUMA node, filled in on first use */
+static struct placement nodes[MAX_NODES];
+static int nodes_length;
+
+static enum { POLICY_NONE, POLICY_SPREAD } policy = POLICY_NONE;
+static int next_node;
+
+/* Parses a list such as 0-3,8,10-11 into set; returns -1 if it isn't one */
+static int parse_cpu_list(const char *text, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*text && *text != '\n') {
+    char *end;
+    long first = strtol(text, &end, 10), last = first;
+    if (end == text)
+      return -1;
+    if (*end == '-') {
+      text = end + 1;
+      last = strtol(text, &end, 10);
+      if (end == text)
+        return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+    text = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0' && *end != '\n')
+      return -1;
+  }
+  return 0;
+}
+
+static int read_cpu_list(const char *path, cpu_set_t *set) {
+  char line[4096];
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+  int result = fgets(line, sizeof(line), file) ? parse_cpu_list(line, set) : -1;
+  fclose(file);
+  return result;
+}
+
+/* Reads the online NUMA nodes and their CPUs. Machines without NUMA information are treated
+ * as a single node holding every CPU. */
+static void nodes_init(void) {
+  if (nodes_length > 0)
+    return;
+
+  cpu_set_t online;
+  if (read_cpu_list("/sys/devices/system/node/online", &online) == 0) {
+    for (int node = 0; node < MAX_NODES; node++) {
+      if (!CPU_ISSET(node, &online))
+        continue;
+      char path[128];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      if (read_cpu_list(path, &nodes[nodes_length].cpus) < 0 ||
+          CPU_COUNT(&nodes[nodes_length].cpus) == 0)
+        continue;
+      nodes[nodes_length++].node = node;
+    }
+  }
+  if (nodes_length == 0) {
+    sched_getaffinity(0, sizeof(cpu_set_t), &nodes[0].cpus);
+    nodes[0].node = -1;
+    nodes_length = 1;
+  }
+}
+
+static const struct placement *node_placement(int node) {
+  nodes_init();
+  for (int i = 0; i < nodes_length; i++)
+    if (nodes[i].node == node)
+      return &nodes[i];
+  return NULL;
+}
+
+const struct placement *placement_default(void) {
+  if (policy == POLICY_NONE)
+    return NULL;
+  nodes_init();
+  if (nodes_length < 2)
+    return NULL;
+  return &nodes[next_node++ % nodes_length];
+}
+
+int placement_apply(const struct placement *placement) {
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) < 0)
+    return -1;
+  if (placement->node >= 0) {
+    unsigned long mask = 1UL << placement->node;
+    if (syscall(SYS_set_mempolicy, MPOL_BIND, &mask, sizeof(mask) * 8) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int place_default(const char *name) {
+  if (name != NULL && strcmp(name, "none") == 0) {
+    policy = POLICY_NONE;
+  } else if (name != NULL && strcmp(name, "spread") == 0) {
+    policy = POLICY_SPREAD;
+  } else {
+    fprintf(stderr, "place: unknown policy: %s\n", name ? name : "");
+    return 1;
+  }
+  return 0;
+}
+
+int cmd_place(struct tokens *tokens) {
+  char *option = tokens_get_token(tokens, 1), *value = tokens_get_token(tokens, 2);
+  if (option == NULL) {
+    nodes_init();
+    printf("policy: %s\n", policy == POLICY_SPREAD ? "spread" : "none");
+    for (int i = 0; i < nodes_length; i++)
+      printf("node %d: %d cpus\n", nodes[i].node, CPU_COUNT(&nodes[i].cpus));
+    return 0;
+  }
+  if (strcmp(option, "-d") == 0)
+    return place_default(value);
+
+  struct placement placement;
+  const struct placement *chosen = NULL;
+  if (value != NULL && strcmp(option, "-c") == 0) {
+    if (parse_cpu_list(value, &placement.cpus) < 0 || CPU_COUNT(&placement.cpus) == 0) {
+      fprintf(stderr, "place: invalid cpu list: %s\n", value);
+      return 1;
+    }
+    placement.node = -1;
+    chosen = &placement;
+  } else if (value != NULL && strcmp(option, "-N") == 0) {
+    if (strcmp(value, "spread") == 0) {
+      nodes_init();
+      chosen = &nodes[next_node++ % nodes_length];
+    } else if ((chosen = node_placement(atoi(value))) == NULL) {
+      fprintf(stderr, "place: no such node: %s\n", value);
+      return 1;
+    }
+  }
+  if (chosen == NULL || tokens_get_length(tokens) < 4) {
+    fprintf(stderr, "usage: place [-c CPUS | -N NODE|spread] COMMAND... | place -d none|spread\n");
+    return 1;
+  }
+
+  struct spawn_attr attr;
+  spawn_attr_init(&attr);
+  attr.placement = chosen;
+  struct pipeline *pipeline = pipeline_from_words(tokens, 3);
+  int status = job_run(pipeline, &attr);
+  pipeline_destroy(pipeline);
+  return status;
+}
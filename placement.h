@@ -0,0 +1,18 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Where a job's processes may run: a set of CPUs and optionally a NUMA node to bind their
+ * memory to */
+struct placement;
+
+/* The placement the default policy picks for the next job, or NULL to leave jobs alone */
+const struct placement *placement_default(void);
+
+/* Applies a placement to the calling process; used in children before exec */
+int placement_apply(const struct placement *placement);
+
+/* Built-in: `place [-c CPUS] [-N NODE|spread] COMMAND...' runs COMMAND on the given CPUs
+ * (a list such as 0-3,8) or NUMA node, with its memory bound to that node. `place -d
+ * none|spread' sets the policy for every job: `spread' hands jobs to the NUMA nodes in turn. */
+int cmd_place(struct tokens *tokens);
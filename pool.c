@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "pool.h"
+
+extern char **environ;
+
+/* What goes ahead of a request on the socket, with its descriptors attached: the command's
+ * three, then the shell's working directory (an O_PATH descriptor), since the helper started
+ * out wherever the shell was back then. The strings follow: the path, the arguments and the
+ * environment, each ending in a NUL. */
+struct pool_header {
+  uint32_t size;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t umask;
+  int32_t pgid;
+  uint8_t foreground;
+  uint8_t job_control;
+};
+
+/* A helper waiting for a command, and the shell's end of its socket */
+struct helper {
+  pid_t pid;
+  int fd;
+};
+
+static struct helper *helpers;
+static size_t helpers_length;
+/* How many helpers should be waiting */
+static size_t pool_size;
+
+static int write_all(int fd, const char *data, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, data, n);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    data += written;
+    n -= written;
+  }
+  return 0;
+}
+
+static int read_all(int fd, char *data, size_t n) {
+  while (n > 0) {
+    ssize_t got = read(fd, data, n);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    data += got;
+    n -= got;
+  }
+  return 0;
+}
+
+/* Runs a new helper on one end of a socket pair. The helper's end is the only descriptor it
+ * gets beyond 0-2 that isn't close-on-exec. */
+static int helper_start(void) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    perror("pool: socketpair");
+    return -1;
+  }
+  fcntl(fds[1], F_SETFD, 0);
+  char fd_text[16];
+  snprintf(fd_text, sizeof(fd_text), "%d", fds[1]);
+  char *argv[] = {"shell", "--pool-helper", fd_text, NULL};
+
+  pid_t pid;
+  int error = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ);
+  close(fds[1]);
+  if (error != 0) {
+    fprintf(stderr, "pool: %s\n", strerror(error));
+    close(fds[0]);
+    return -1;
+  }
+  helpers = (struct helper *) realloc(helpers, sizeof(struct helper) * (helpers_length + 1));
+  helpers[helpers_length].pid = pid;
+  helpers[helpers_length++].fd = fds[0];
+  return 0;
+}
+
+/* Ends a helper that never got a command: it exits when its socket closes */
+static void helper_stop(struct helper *helper) {
+  close(helper->fd);
+  waitpid(helper->pid, NULL, 0);
+}
+
+bool pool_ready(void) {
+  return helpers_length > 0;
+}
+
+pid_t pool_exec(const struct pool_request *request) {
+  if (helpers_length == 0)
+    return -1;
+  int fds[4] = {request->fds[0], request->fds[1], request->fds[2]};
+  fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fds[3] < 0)
+    return -1;
+  struct helper helper = helpers[--helpers_length];
+
+  struct pool_header header = {0};
+  header.size = strlen(request->path) + 1;
+  for (; request->argv[header.argc] != NULL; header.argc++)
+    header.size += strlen(request->argv[header.argc]) + 1;
+  for (; request->envp[header.envc] != NULL; header.envc++)
+    header.size += strlen(request->envp[header.envc]) + 1;
+  mode_t mask = umask(0);
+  umask(mask);
+  header.umask = mask;
+  header.pgid = request->pgid;
+  header.foreground = request->foreground;
+  header.job_control = request->job_control;
+
+  /* The strings are flattened into one buffer so that they go out in a single write */
+  char *strings = (char *) malloc(header.size), *end = strings;
+  end = stpcpy(end, request->path) + 1;
+  for (uint32_t i = 0; i < header.argc; i++)
+    end = stpcpy(end, request->argv[i]) + 1;
+  for (uint32_t i = 0; i < header.envc; i++)
+    end = stpcpy(end, request->envp[i]) + 1;
+
+  struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  /* The helper answers once it is in its process group, so the job can be given the terminal
+   * and signalled as soon as this returns */
+  char ack;
+  ssize_t sent;
+  do
+    sent = sendmsg(helper.fd, &msg, MSG_NOSIGNAL);
+  while (sent < 0 && errno == EINTR);
+  bool taken = sent == sizeof(header) && write_all(helper.fd, strings, header.size) == 0 &&
+      read_all(helper.fd, &ack, 1) == 0;
+  free(strings);
+  close(fds[3]);
+  close(helper.fd);
+  if (!taken) {
+    /* It is gone or going; the job table doesn't know it, so whoever reaps it ignores it */
+    kill(helper.pid, SIGKILL);
+    return -1;
+  }
+  return helper.pid;
+}
+
+void pool_refill(void) {
+  while (helpers_length < pool_size && helper_start() == 0)
+    ;
+}
+
+void pool_helper_main(int fd) {
+  struct pool_header header;
+  int fds[4];
+  struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t got;
+  do
+    got = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  while (got < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (got != sizeof(header) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    _exit(0);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  char *strings = (char *) malloc(header.size);
+  if (strings == NULL || read_all(fd, strings, header.size) < 0)
+    _exit(1);
+  char *argv[header.argc + 1], *envp[header.envc + 1];
+  char *path = strings, *next = strings + strlen(strings) + 1;
+  for (uint32_t i = 0; i < header.argc; i++, next += strlen(next) + 1)
+    argv[i] = next;
+  for (uint32_t i = 0; i < header.envc; i++, next += strlen(next) + 1)
+    envp[i] = next;
+  argv[header.argc] = NULL;
+  envp[header.envc] = NULL;
+
+  /* The same steps as a child forked by the shell, with the terminal still on stdin */
+  if (fchdir(fds[3]) < 0)
+    _exit(1);
+  umask(header.umask);
+  if (header.pgid >= 0) {
+    pid_t pgid = header.pgid ? header.pgid : getpid();
+    setpgid(0, pgid);
+    if (header.foreground)
+      tcsetpgrp(STDIN_FILENO, pgid);
+  }
+  if (header.job_control)
+    job_control_reset();
+  char ack = 0;
+  if (write_all(fd, &ack, 1) < 0)
+    _exit(1);
+
+  for (int i = 0; i < 3; i++)
+    dup2(fds[i], i);
+  fds_close_on_exec();
+  execve(path, argv, envp);
+  fprintf(stderr, "shell: %s: %s\n", argv[0], strerror(errno));
+  _exit(errno == ENOENT ? 127 : 126);
+}
+
+int cmd_pool(struct tokens *tokens) {
+  char *action = tokens_get_token(tokens, 1);
+  size_t length = tokens_get_length(tokens);
+  if (action == NULL) {
+    for (size_t i = 0; i < helpers_length; i++)
+      printf("%d\n", (int) helpers[i].pid);
+    return 0;
+  }
+
+  if (strcmp(action, "start") == 0 && length == 3) {
+    char *end;
+    long size = strtol(tokens_get_token(tokens, 2), &end, 10);
+    if (*end == '\0' && size > 0 && size <= 1024) {
+      pool_size = size;
+      while (helpers_length > pool_size)
+        helper_stop(&helpers[--helpers_length]);
+      pool_refill();
+      return helpers_length == pool_size ? 0 : 1;
+    }
+  } else if (strcmp(action, "stop") == 0 && length == 2) {
+    pool_size = 0;
+    while (helpers_length > 0)
+      helper_stop(&helpers[--helpers_length]);
+    return 0;
+  }
+
+  fprintf(stderr, "usage: pool [start N | stop]\n");
+  return 2;
+}
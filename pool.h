@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "tokenizer.h"
+
+/* A pool of helper processes to start commands with. A helper is a fresh run of the shell's own
+ * executable, so it stays small however big the shell grows. It waits on a socket for one
+ * command, then joins the job's process group, takes the command's descriptors and the shell's
+ * working directory and umask as they are now, and execs it, becoming that command as an
+ * ordinary child of the shell. The shell forks nothing on the way, and replaces the helper
+ * with posix_spawn(), which doesn't copy the shell's memory either. */
+
+/* What a helper needs to become a command */
+struct pool_request {
+  const char *path;
+  char **argv;
+  char **envp;
+  /* The command's stdin, stdout and stderr */
+  int fds[3];
+  /* Process group to join: 0 to start one, -1 to stay in the shell's */
+  pid_t pgid;
+  /* Give the job's process group the terminal */
+  bool foreground;
+  /* Put back the job control signals, which an interactive shell ignores */
+  bool job_control;
+};
+
+/* Is there a helper waiting? */
+bool pool_ready(void);
+
+/* Hands the request to a waiting helper. Returns the helper's pid once it is in its process
+ * group (and has the terminal), or -1 if it couldn't take the command. */
+pid_t pool_exec(const struct pool_request *request);
+
+/* Starts helpers to make up for those used since the last call */
+void pool_refill(void);
+
+/* Serves as a helper on the socket fd; never returns. The shell runs `shell --pool-helper FD'. */
+void pool_helper_main(int fd);
+
+/* Built-in: `pool start N' keeps N helpers waiting, `pool stop' ends them and `pool' lists
+ * them */
+int cmd_pool(struct tokens *tokens);
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "profile.h"
+
+#define MAX_SAMPLES 8192
+#define MAX_DEPTH 32
+
+struct sample {
+  int depth;
+  /* The interrupted instruction, then the return addresses of its callers */
+  void *frames[MAX_DEPTH];
+};
+
+static struct sample *samples;
+static volatile sig_atomic_t samples_length;
+static volatile sig_atomic_t samples_dropped;
+static int profiling;
+/* The SIGPROF action from before `profile start', put back by `profile stop' */
+static struct sigaction old_action;
+/* The shell's stack, which every frame pointer followed must point into */
+static uintptr_t stack_low, stack_high;
+
+/* Walks the frame pointer chain of the interrupted code, which the build keeps with
+ * -fno-omit-frame-pointer. Unlike backtrace() this takes no locks and loads nothing, so it is
+ * safe in a signal handler; a frame pointer outside the stack or not above the last one (code
+ * built without them, or a function in its prologue) ends the walk. */
+static int stack_walk(const ucontext_t *context, void **frames) {
+#if defined(__x86_64__)
+  uintptr_t pc = context->uc_mcontext.gregs[REG_RIP];
+  uintptr_t fp = context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+  uintptr_t pc = context->uc_mcontext.pc;
+  uintptr_t fp = context->uc_mcontext.regs[29];
+#else
+  /* No known register layout, so no stacks */
+  return 0;
+#define NO_STACK_WALK
+#endif
+#ifndef NO_STACK_WALK
+  int depth = 0;
+  frames[depth++] = (void *) pc;
+  /* Each frame holds the caller's frame pointer, then the return address */
+  while (depth < MAX_DEPTH && fp % sizeof(uintptr_t) == 0 && fp >= stack_low &&
+      fp <= stack_high - 2 * sizeof(uintptr_t)) {
+    uintptr_t *frame = (uintptr_t *) fp;
+    if (frame[1] == 0)
+      break;
+    frames[depth++] = (void *) frame[1];
+    if (frame[0] <= fp)
+      break;
+    fp = frame[0];
+  }
+  return depth;
+#endif
+}
+
+static void profile_handler(int sig, siginfo_t *info, void *context) {
+  if (samples_length >= MAX_SAMPLES) {
+    samples_dropped++;
+    return;
+  }
+  struct sample *sample = &samples[samples_length];
+  sample->depth = stack_walk((const ucontext_t *) context, sample->frames);
+  samples_length++;
+}
+
+/* Finds the bounds of the calling thread's stack */
+static int stack_bounds(void) {
+  pthread_attr_t attr;
+  void *address;
+  size_t size;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return -1;
+  int result = pthread_attr_getstack(&attr, &address, &size);
+  pthread_attr_destroy(&attr);
+  if (result != 0)
+    return -1;
+  stack_low = (uintptr_t) address;
+  stack_high = stack_low + size;
+  return 0;
+}
+
+static int profile_start(int hz) {
+  if (profiling) {
+    fprintf(stderr, "profile: already running\n");
+    return 1;
+  }
+  if (samples == NULL)
+    samples = (struct sample *) malloc(sizeof(struct sample) * MAX_SAMPLES);
+  samples_length = 0;
+  samples_dropped = 0;
+  if (stack_low == 0 && stack_bounds() < 0) {
+    fprintf(stderr, "profile: can't find the stack\n");
+    return 1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = profile_handler;
+  action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+    perror("profile");
+    sigaction(SIGPROF, &old_action, NULL);
+    return 1;
+  }
+  profiling = 1;
+  return 0;
+}
+
+static void profile_stop(void) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  /* Ignoring it first discards a tick still pending, which the default action (usually the
+   * one put back, and what commands started from now on inherit) would end the shell with */
+  signal(SIGPROF, SIG_IGN);
+  sigaction(SIGPROF, &old_action, NULL);
+  profiling = 0;
+}
+
+/* Appends the name of the function containing address to buffer */
+static void append_symbol(char *buffer, size_t size, void *address, bool returned) {
+  Dl_info info;
+  size_t length = strlen(buffer);
+  /* Return addresses point just past the call, which may already be the next function */
+  void *call = (char *) address - (returned ? 1 : 0);
+  if (dladdr(call, &info) && info.dli_sname != NULL) {
+    snprintf(buffer + length, size - length, "%s", info.dli_sname);
+  } else if (dladdr(call, &info) && info.dli_fname != NULL) {
+    const char *base = strrchr(info.dli_fname, '/');
+    snprintf(buffer + length, size - length, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+        (unsigned long) ((char *) call - (char *) info.dli_fbase));
+  } else {
+    snprintf(buffer + length, size - length, "%p", call);
+  }
+}
+
+static int compare_stacks(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+static int profile_dump(const char *path) {
+  FILE *out = path ? fopen(path, "w") : stdout;
+  if (out == NULL) {
+    perror("profile");
+    return 1;
+  }
+
+  /* Keep the dump itself out of the profile */
+  sigset_t prof, old;
+  sigemptyset(&prof);
+  sigaddset(&prof, SIGPROF);
+  sigprocmask(SIG_BLOCK, &prof, &old);
+
+  size_t length = samples_length;
+  char **stacks = (char **) malloc(sizeof(char *) * (length + 1));
+  for (size_t i = 0; i < length; i++) {
+    char buffer[MAX_DEPTH * 64] = "";
+    for (int j = samples[i].depth - 1; j >= 0; j--) {
+      append_symbol(buffer, sizeof(buffer), samples[i].frames[j], j > 0);
+      if (j > 0)
+        strncat(buffer, ";", sizeof(buffer) - strlen(buffer) - 1);
+    }
+    stacks[i] = strdup(buffer);
+  }
+
+  /* Identical stacks end up next to each other and are printed once, with their count */
+  qsort(stacks, length, sizeof(char *), compare_stacks);
+  for (size_t i = 0, run = 1; i < length; i++, run++) {
+    if (i + 1 == length || strcmp(stacks[i], stacks[i + 1]) != 0) {
+      fprintf(out, "%s %zu\n", stacks[i], run);
+      run = 0;
+    }
+  }
+  for (size_t i = 0; i < length; i++)
+    free(stacks[i]);
+  free(stacks);
+
+  if (samples_dropped)
+    fprintf(stderr, "profile: %d samples dropped\n", (int) samples_dropped);
+  if (path)
+    fclose(out);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return 0;
+}
+
+int cmd_profile(struct tokens *tokens) {
+  char *action = tokens_get_token(tokens, 1);
+  if (action != NULL && strcmp(action, "start") == 0) {
+    char *hz = tokens_get_token(tokens, 2);
+    int rate = hz ? atoi(hz) : 997;
+    if (rate <= 0 || rate > 1000000) {
+      fprintf(stderr, "profile: invalid rate: %s\n", hz);
+      return 1;
+    }
+    return profile_start(rate);
+  } else if (action != NULL && strcmp(action, "stop") == 0) {
+    profile_stop();
+    return 0;
+  } else if (action != NULL && strcmp(action, "dump") == 0) {
+    return profile_dump(tokens_get_token(tokens, 2));
+  }
+  fprintf(stderr, "usage: profile start [HZ] | stop | dump [FILE]\n");
+  return 1;
+}
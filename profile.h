@@ -0,0 +1,8 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Built-in: `profile start [HZ]' samples the shell's own stacks on SIGPROF, `profile stop'
+ * stops sampling and `profile dump [FILE]' writes the samples as folded stacks, the input
+ * format of flamegraph.pl */
+int cmd_profile(struct tokens *tokens);
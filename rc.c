@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rc.h"
+#include "shell.h"
+
+#define RC_CACHE_MAGIC "SHRCTOK\0"
+#define RC_CACHE_VERSION 1
+
+/* A cache file is this header, then one flat block per line (leaving out lines with no words),
+ * each padded to four bytes. The header names the file it was made from; the cache is stale
+ * as soon as any of these differ. */
+struct rc_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t lines;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+#define PADDED(size) (((size) + 3) & ~(size_t) 3)
+
+static void header_init(struct rc_cache_header *header, const struct stat *st, size_t lines) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, RC_CACHE_MAGIC, sizeof(header->magic));
+  header->version = RC_CACHE_VERSION;
+  header->lines = lines;
+  header->dev = st->st_dev;
+  header->ino = st->st_ino;
+  header->size = st->st_size;
+  header->mtime_sec = st->st_mtim.tv_sec;
+  header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Where the cache for a file goes, under $XDG_CACHE_HOME or ~/.cache; the directory is made if
+ * create is set. Returns false if there is no home to put it in. */
+static bool cache_path(const struct stat *st, char *path, size_t size, bool create) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX];
+  if (base != NULL && base[0] == '/')
+    snprintf(dir, sizeof(dir), "%s/shell", base);
+  else if (home != NULL && home[0] == '/')
+    snprintf(dir, sizeof(dir), "%s/.cache/shell", home);
+  else
+    return false;
+  if (create) {
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+    mkdir(dir, 0700);
+  }
+  snprintf(path, size, "%s/rc-%llx-%llx", dir, (unsigned long long) st->st_dev,
+      (unsigned long long) st->st_ino);
+  return true;
+}
+
+/* Reads the words of the file described by st from its cache. Returns the lines, or NULL if
+ * there is no cache or it is stale or damaged. */
+static struct tokens **cache_load(const struct stat *st, size_t *length) {
+  char path[PATH_MAX];
+  if (!cache_path(st, path, sizeof(path), false))
+    return NULL;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat cache_st;
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &cache_st) < 0 || cache_st.st_size < (off_t) sizeof(struct rc_cache_header)) {
+    close(fd);
+    return NULL;
+  }
+  const char *image = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return NULL;
+
+  struct rc_cache_header header, expected;
+  memcpy(&header, image, sizeof(header));
+  header_init(&expected, st, header.lines);
+  struct tokens **lines = NULL;
+  size_t n = 0;
+  /* Every line takes up at least four bytes, which bounds a damaged count */
+  size_t most = (cache_st.st_size - sizeof(header)) / 4;
+  if (memcmp(&header, &expected, sizeof(header)) == 0 && header.lines <= most)
+    lines = (struct tokens **) malloc(sizeof(struct tokens *) * (header.lines + 1));
+  if (lines != NULL) {
+    size_t offset = sizeof(header);
+    for (; n < header.lines; n++) {
+      const void *block = image + offset;
+      if (!flat_tokens_check(block, cache_st.st_size - offset))
+        break;
+      struct flat_tokens *flat = (struct flat_tokens *) block;
+      size_t size = PADDED(flat_tokens_size(flat));
+      if (size > cache_st.st_size - offset)
+        break;
+      lines[n] = flat_tokens_unflatten(flat);
+      offset += size;
+    }
+  }
+  munmap((void *) image, cache_st.st_size);
+
+  if (lines != NULL && n < header.lines) {
+    for (size_t i = 0; i < n; i++)
+      tokens_destroy(lines[i]);
+    free(lines);
+    lines = NULL;
+  }
+  *length = n;
+  return lines;
+}
+
+/* Writes the words of the file described by st to its cache. Nothing is written if the file
+ * changed within the last second, as another change in the same second could leave its mtime
+ * and size as they are. */
+static void cache_store(const struct stat *st, struct tokens **lines, size_t length) {
+  char path[PATH_MAX];
+  if (time(NULL) <= st->st_mtim.tv_sec + 1 || !cache_path(st, path, sizeof(path), true))
+    return;
+
+  struct rc_cache_header header;
+  header_init(&header, st, length);
+  size_t size = sizeof(header);
+  struct flat_tokens *flats[length + 1];
+  for (size_t i = 0; i < length; i++) {
+    flats[i] = tokens_flatten(lines[i]);
+    size += PADDED(flat_tokens_size(flats[i]));
+    if (flats[i] == NULL) {
+      /* A line too long for a flat block; the file is simply read each time */
+      while (i > 0)
+        flat_tokens_destroy(flats[--i]);
+      return;
+    }
+  }
+  char *buf = (char *) calloc(1, size), *end = buf + sizeof(header);
+  memcpy(buf, &header, sizeof(header));
+  for (size_t i = 0; i < length; i++) {
+    memcpy(end, flats[i], flat_tokens_size(flats[i]));
+    end += PADDED(flat_tokens_size(flats[i]));
+    flat_tokens_destroy(flats[i]);
+  }
+
+  /* Written aside and renamed into place, so a shell starting meanwhile never reads half */
+  char temp[sizeof(path) + 8];
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+  int fd = mkostemp(temp, O_CLOEXEC);
+  if (fd >= 0) {
+    bool written = write(fd, buf, size) == (ssize_t) size;
+    if (close(fd) < 0 || !written || rename(temp, path) < 0)
+      unlink(temp);
+  }
+  free(buf);
+}
+
+/* Reads and tokenizes the whole file, keeping the lines that have words */
+static struct tokens **file_tokenize(int fd, const struct stat *st, size_t *length) {
+  char *text = (char *) malloc(st->st_size + 1);
+  size_t size = 0;
+  ssize_t got;
+  while ((got = read(fd, text + size, st->st_size - size)) > 0 ||
+      (got < 0 && errno == EINTR))
+    size += got > 0 ? got : 0;
+  text[size] = '\0';
+
+  struct tokens **lines = NULL;
+  size_t n = 0;
+  for (char *line = text, *next; line < text + size; line = next) {
+    char *newline = strchr(line, '\n');
+    next = newline ? newline + 1 : text + size;
+    if (newline != NULL)
+      *newline = '\0';
+    struct tokens *tokens = tokenize(line);
+    if (tokens_get_length(tokens) == 0) {
+      tokens_destroy(tokens);
+      continue;
+    }
+    lines = (struct tokens **) realloc(lines, sizeof(struct tokens *) * (n + 1));
+    lines[n++] = tokens;
+  }
+  free(text);
+  *length = n;
+  return lines;
+}
+
+int rc_source(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  size_t length;
+  struct tokens **lines = cache_load(&st, &length);
+  if (lines == NULL) {
+    lines = file_tokenize(fd, &st, &length);
+    /* Only cache what was read from the file as it still is */
+    struct stat after;
+    if (fstat(fd, &after) == 0 && after.st_size == st.st_size &&
+        after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+      cache_store(&st, lines, length);
+  }
+  close(fd);
+
+  int status = 0;
+  for (size_t i = 0; i < length; i++) {
+    status = run_tokens(lines[i]);
+    tokens_destroy(lines[i]);
+  }
+  free(lines);
+  return status;
+}
+
+void rc_load(void) {
+  const char *path = getenv("SHELLRC");
+  char home_rc[PATH_MAX];
+  if (path == NULL) {
+    const char *home = getenv("HOME");
+    if (home == NULL)
+      return;
+    snprintf(home_rc, sizeof(home_rc), "%s/.shellrc", home);
+    path = home_rc;
+  }
+  if (access(path, F_OK) == 0)
+    rc_source(path);
+}
+
+int cmd_source(struct tokens *tokens) {
+  char *path = tokens_get_token(tokens, 1);
+  if (path == NULL || tokens_get_length(tokens) != 2) {
+    fprintf(stderr, "usage: source FILE\n");
+    return 2;
+  }
+  int status = rc_source(path);
+  return status < 0 ? 1 : status;
+}
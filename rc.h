@@ -0,0 +1,14 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Runs the commands in a file, line by line. The words of its lines are cached on disk, keyed
+ * by the file's device, inode, mtime and size, so an unchanged file isn't tokenized again.
+ * Returns the status of the last command, or -1 (after a message) if the file can't be read. */
+int rc_source(const char *path);
+
+/* Sources $SHELLRC, or ~/.shellrc, if it exists; an interactive shell does this at startup */
+void rc_load(void);
+
+/* Built-in: `source FILE' runs the commands in FILE in this shell */
+int cmd_source(struct tokens *tokens);
@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "parse.h"
+#include "retry.h"
+#include "timing.h"
+
+struct backoff {
+  bool exponential;
+  uint64_t min_ns;
+  uint64_t max_ns;
+};
+
+/* Parses exp:MIN..MAX or fixed:DELAY */
+static int parse_backoff(const char *text, struct backoff *backoff) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s", text);
+  char *colon = strchr(buf, ':');
+  if (colon == NULL)
+    return -1;
+  *colon = '\0';
+  char *spec = colon + 1;
+
+  if (strcmp(buf, "fixed") == 0) {
+    long long delay = parse_duration(spec);
+    backoff->exponential = false;
+    backoff->min_ns = backoff->max_ns = delay;
+    return delay < 0 ? -1 : 0;
+  }
+  char *dots = strstr(spec, "..");
+  if (strcmp(buf, "exp") != 0 || dots == NULL)
+    return -1;
+  *dots = '\0';
+  long long min = parse_duration(spec), max = parse_duration(dots + 2);
+  if (min <= 0 || max < min)
+    return -1;
+  backoff->exponential = true;
+  backoff->min_ns = min;
+  backoff->max_ns = max;
+  return 0;
+}
+
+/* The delay before the attempt after the given one (counting from 0): doubling from the
+ * minimum, capped at the maximum, then a random point in its upper half so that many shells
+ * retrying together spread out */
+static uint64_t backoff_delay(const struct backoff *backoff, int attempt) {
+  if (!backoff->exponential)
+    return backoff->min_ns;
+  uint64_t delay = backoff->min_ns;
+  for (int i = 0; i < attempt && delay < backoff->max_ns; i++)
+    delay *= 2;
+  if (delay > backoff->max_ns)
+    delay = backoff->max_ns;
+  return delay / 2 + (uint64_t) ((double) random() / RAND_MAX * (delay / 2));
+}
+
+static volatile sig_atomic_t sigint_caught;
+
+static void interrupted(int sig) {
+  sigint_caught = 1;
+}
+
+/* Sleeps on a timerfd. SIGINT is caught for the duration, even if the shell ignores it, so
+ * that it cuts the sleep short; returns -1 if it did. Other signals (such as the SIGPROF of
+ * `profile start') only restart the wait. */
+static int backoff_sleep(uint64_t ns) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd < 0)
+    return usleep(ns / 1000);
+
+  struct itimerspec spec = {{0, 0}, {ns / 1000000000, ns % 1000000000}};
+  timerfd_settime(fd, 0, &spec, NULL);
+
+  struct sigaction action, old;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupted;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, &old);
+
+  struct pollfd pfd = {fd, POLLIN, 0};
+  sigint_caught = 0;
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR && !sigint_caught)
+    ;
+
+  sigaction(SIGINT, &old, NULL);
+  close(fd);
+  return sigint_caught ? -1 : 0;
+}
+
+int cmd_retry(struct tokens *tokens) {
+  struct backoff backoff = {true, 100000000, 10000000000ULL};
+  int attempts = 3;
+
+  size_t i = 1;
+  for (; i + 1 < tokens_get_length(tokens); i += 2) {
+    char *option = tokens_get_token(tokens, i), *value = tokens_get_token(tokens, i + 1);
+    if (strcmp(option, "-n") == 0) {
+      char *end;
+      long n = strtol(value, &end, 10);
+      if (*value == '\0' || *end != '\0' || n < 1 || n > INT_MAX) {
+        fprintf(stderr, "retry: invalid number of attempts: %s\n", value);
+        return 2;
+      }
+      attempts = n;
+    } else if (strcmp(option, "--backoff") == 0) {
+      if (parse_backoff(value, &backoff) < 0) {
+        fprintf(stderr, "retry: invalid backoff: %s\n", value);
+        return 2;
+      }
+    } else {
+      break;
+    }
+  }
+  if (attempts < 1 || i >= tokens_get_length(tokens)) {
+    fprintf(stderr, "usage: retry [-n ATTEMPTS] [--backoff exp:MIN..MAX | fixed:DELAY] "
+        "COMMAND...\n");
+    return 2;
+  }
+
+  static bool seeded;
+  if (!seeded) {
+    srandom(clock_now_ns() ^ getpid());
+    seeded = true;
+  }
+
+  struct pipeline *pipeline = pipeline_from_words(tokens, i);
+  int status = 1;
+  for (int attempt = 0; attempt < attempts; attempt++) {
+    uint64_t start = clock_now_ns();
+    status = job_run(pipeline, NULL);
+    uint64_t elapsed = clock_now_ns() - start;
+
+    fprintf(stderr, "retry: attempt %d/%d exited %d after %llu.%09llus", attempt + 1, attempts,
+        status, (unsigned long long) (elapsed / 1000000000),
+        (unsigned long long) (elapsed % 1000000000));
+    /* As after any command, ^C stops the rest of the line */
+    if (status == 0 || attempt + 1 == attempts || status == 128 + SIGINT) {
+      fputc('\n', stderr);
+      break;
+    }
+
+    uint64_t delay = backoff_delay(&backoff, attempt);
+    fprintf(stderr, ", retrying in %llu.%03llus\n", (unsigned long long) (delay / 1000000000),
+        (unsigned long long) (delay % 1000000000 / 1000000));
+    if (backoff_sleep(delay) < 0) {
+      fprintf(stderr, "retry: interrupted\n");
+      break;
+    }
+  }
+  pipeline_destroy(pipeline);
+  return status;
+}
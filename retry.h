@@ -0,0 +1,8 @@
+#pragma once
+
+#include "tokenizer.h"
+
+/* Built-in: `retry [-n ATTEMPTS] [--backoff exp:MIN..MAX | fixed:DELAY] COMMAND...' runs
+ * COMMAND until it succeeds, at most ATTEMPTS times (3), sleeping between attempts. The
+ * exponential backoff doubles from MIN up to MAX with random jitter. */
+int cmd_retry(struct tokens *tokens);
@@ -1,16 +1,38 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "alias.h"
+#include "capture.h"
+#include "coproc.h"
+#include "evloop.h"
+#include "job.h"
+#include "limit.h"
+#include "metrics.h"
+#include "parse.h"
+#include "placement.h"
+#include "pool.h"
+#include "profile.h"
+#include "rc.h"
+#include "retry.h"
+#include "snapshot.h"
+#include "shell.h"
+#include "timing.h"
 #include "tokenizer.h"
+#include "vars.h"
 
 /* Whether the shell is connected to an actual terminal or not. */
 bool shell_is_interactive;
@@ -26,27 +48,48 @@ pid_t shell_pgid;
 
 int cmd_exit(struct tokens *tokens);
 int cmd_help(struct tokens *tokens);
-
-/* Built-in command functions take token array (see parse.h) and return int */
-typedef int cmd_fun_t(struct tokens *tokens);
-
-/* Built-in command struct and lookup table */
-typedef struct fun_desc {
-  cmd_fun_t *fun;
-  char *cmd;
-  char *doc;
-} fun_desc_t;
+int cmd_cd(struct tokens *tokens);
+int cmd_pwd(struct tokens *tokens);
 
 fun_desc_t cmd_table[] = {
-  {cmd_help, "?", "show this help menu"},
+  {cmd_help, "?", "show this help menu", BUILTIN_SUBSHELL_SAFE},
   {cmd_exit, "exit", "exit the command shell"},
+  {cmd_cd, "cd", "change the working directory: cd [DIR | -]", BUILTIN_SUBSHELL_SAFE},
+  {cmd_pwd, "pwd", "print the working directory", BUILTIN_SUBSHELL_SAFE},
+  {cmd_capture, "capture", "copy a command's output to files and memory buffers"},
+  {cmd_coproc, "coproc", "start a coprocess: coproc [-n NAME] COMMAND... | -c NAME"},
+  {cmd_cosend, "cosend", "send a line to a coprocess: cosend [-f] NAME WORD..."},
+  {cmd_corecv, "corecv", "read a line from a coprocess: corecv [-t DURATION] NAME [VAR]"},
+  {cmd_jobs, "jobs", "list the jobs started from this shell"},
+  {cmd_fg, "fg", "continue a job in the foreground: fg [%N]"},
+  {cmd_bg, "bg", "continue a stopped job in the background: bg [%N]"},
+  {cmd_limit, "limit",
+      "run a command with resource limits: limit [-t S] [-m B] [-n N] [-g F=V]..."},
+  {cmd_retry, "retry", "rerun a failing command: retry [-n N] [--backoff exp:MIN..MAX] ...",
+      BUILTIN_SUBSHELL_SAFE},
+  {cmd_declare, "declare", "make arrays or print variables: declare [-a | -A | -p] [NAME]...",
+      BUILTIN_SUBSHELL_SAFE},
+  {cmd_unset, "unset", "remove variables or array elements: unset NAME[KEY]...",
+      BUILTIN_SUBSHELL_SAFE},
+  {cmd_export, "export", "pass variables to commands: export [NAME[=VALUE]]...",
+      BUILTIN_SUBSHELL_SAFE},
+  {cmd_timeout, "timeout", "run a command with a time limit: timeout [-k DURATION] DURATION ...",
+      BUILTIN_SUBSHELL_SAFE},
+  {cmd_pipesize, "pipesize", "print or set the pipe size for pipelines: pipesize [SIZE | default]"},
+  {cmd_pool, "pool", "keep helper processes to start commands with: pool [start N | stop]"},
+  {cmd_source, "source", "run the commands in a file in this shell: source FILE"},
+  {cmd_alias, "alias", "define or print aliases: alias [NAME[=VALUE]]..."},
+  {cmd_unalias, "unalias", "remove aliases: unalias -a | NAME..."},
+  {cmd_metrics, "metrics", "print or export command latency histograms"},
+  {cmd_place, "place", "run a command on given CPUs or NUMA node; -d sets the default policy"},
+  {cmd_profile, "profile", "sample the shell's own stacks: start [HZ], stop, dump [FILE]"},
 };
 
 /* Prints a helpful description for the given command */
 int cmd_help(struct tokens *tokens) {
   for (int i = 0; i < sizeof(cmd_table) / sizeof(fun_desc_t); i++)
     printf("%s - %s\n", cmd_table[i].cmd, cmd_table[i].doc);
-  return 1;
+  return 0;
 }
 
 /* Exits this shell */
@@ -54,6 +97,44 @@ int cmd_exit(struct tokens *tokens) {
   exit(0);
 }
 
+/* Changes the working directory, to $HOME by default or $OLDPWD for `-' */
+int cmd_cd(struct tokens *tokens) {
+  const char *dir = tokens_get_token(tokens, 1);
+  bool back = dir != NULL && strcmp(dir, "-") == 0;
+  if (dir == NULL || back)
+    dir = vars_get(back ? "OLDPWD" : "HOME", NULL);
+  if (dir == NULL) {
+    fprintf(stderr, "cd: %s not set\n", back ? "OLDPWD" : "HOME");
+    return 1;
+  }
+
+  char old[PATH_MAX], new[PATH_MAX];
+  bool known = getcwd(old, sizeof(old)) != NULL;
+  if (chdir(dir) < 0) {
+    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  if (known)
+    vars_setenv("OLDPWD", old);
+  if (getcwd(new, sizeof(new)) != NULL) {
+    vars_setenv("PWD", new);
+    if (back)
+      printf("%s\n", new);
+  }
+  return 0;
+}
+
+/* Prints the working directory */
+int cmd_pwd(struct tokens *tokens) {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    perror("pwd");
+    return 1;
+  }
+  printf("%s\n", cwd);
+  return 0;
+}
+
 /* Looks up the built-in command, if it exists. */
 int lookup(char cmd[]) {
   for (int i = 0; i < sizeof(cmd_table) / sizeof(fun_desc_t); i++)
@@ -77,8 +158,15 @@ void init_shell() {
     while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
       kill(-shell_pgid, SIGTTIN);
 
-    /* Saves the shell's process id */
+    /* Ignore the job control signals; they are meant for the foreground job */
+    job_control_init();
+
+    /* Put the shell in its own process group */
     shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM) {
+      perror("Couldn't put the shell in its own process group");
+      exit(1);
+    }
 
     /* Take control of the terminal */
     tcsetpgrp(shell_terminal, shell_pgid);
@@ -88,8 +176,224 @@ void init_shell() {
   }
 }
 
+/* Can a subshell run in the shell's own process? Only if nothing in it can change the shell's
+ * state beyond its variables and working directory, which subshell_run() puts back: every
+ * built-in it names has to be known to be safe, and it can't start background jobs. */
+static bool subshell_is_safe(struct list *list) {
+  for (size_t i = 0; i < list->length; i++) {
+    struct pipeline *pipeline = list->items[i].pipeline;
+    if (pipeline->flags & PIPELINE_BACKGROUND)
+      return false;
+    for (size_t j = 0; j < pipeline->length; j++) {
+      struct command *command = &pipeline->commands[j];
+      if (command->subshell != NULL) {
+        if (!subshell_is_safe(command->subshell))
+          return false;
+        continue;
+      }
+      if (tokens_get_length(command->words) == 0)
+        continue;
+      /* A command named by a variable could turn out to be anything */
+      char *name = tokens_get_token(command->words, 0);
+      int fundex = lookup(name);
+      if (strchr(name, TOKEN_EXPAND) != NULL ||
+          (fundex >= 0 && !(cmd_table[fundex].flags & BUILTIN_SUBSHELL_SAFE)))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* Runs a subshell without forking: its variables go in a scope of their own and the working
+ * directory is put back afterwards, so the shell ends up as if it had run in a child */
+static int subshell_run(struct command *command) {
+  int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int saved[3] = {-1, -1, -1};
+  int status = 1;
+  vars_push_scope();
+  if (redirects_apply(command, saved) == 0)
+    status = run_list(command->subshell);
+  redirects_restore(saved);
+  vars_pop_scope();
+  if (cwd >= 0) {
+    if (fchdir(cwd) < 0)
+      perror("shell: fchdir");
+    close(cwd);
+  }
+  return status;
+}
+
+/* Runs a pipeline and returns its exit status. A lone built-in runs inside the shell itself so
+ * that it can change the shell's state; anything else gets its own processes. */
+int run_pipeline(struct pipeline *pipeline) {
+  struct rusage self_before, usage = {0};
+  int status = 0;
+
+  if (pipeline->flags & PIPELINE_TIME)
+    getrusage(RUSAGE_SELF, &self_before);
+  uint64_t start = clock_now_ns();
+
+  /* A lone command's words are expanded here, so that a variable can name a built-in. A
+   * built-in given process substitutions runs in a child, which can hold the pipes. */
+  struct command *command = pipeline->length > 0 ? &pipeline->commands[0] : NULL;
+  struct tokens *expanded = NULL, *words = command ? command->words : NULL;
+  bool lone = pipeline->length == 1 && command->substitutions_length == 0 &&
+      !(pipeline->flags & PIPELINE_BACKGROUND);
+  if (lone && (expanded = vars_expand_words(words)) != NULL)
+    command->words = expanded;
+  int fundex = lone && tokens_get_length(command->words) > 0 ?
+      lookup(tokens_get_token(command->words, 0)) : -1;
+
+  if (lone && command->subshell != NULL && subshell_is_safe(command->subshell)) {
+    struct rusage children_before, children_after;
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    status = subshell_run(command);
+    getrusage(RUSAGE_CHILDREN, &children_after);
+    usage.ru_utime = children_after.ru_utime;
+    usage.ru_stime = children_after.ru_stime;
+    timersub(&usage.ru_utime, &children_before.ru_utime, &usage.ru_utime);
+    timersub(&usage.ru_stime, &children_before.ru_stime, &usage.ru_stime);
+  } else if (lone && command->subshell == NULL && tokens_get_length(words) == 0) {
+    /* Nothing but assignments, which are for the shell itself */
+    int saved[3] = {-1, -1, -1};
+    status = redirects_apply(command, saved) < 0 ? 1 : 0;
+    for (size_t i = 0; status == 0 && i < command->assignments_length; i++)
+      if (vars_assign(&command->assignments[i], false) < 0)
+        status = 1;
+    redirects_restore(saved);
+  } else if (fundex >= 0) {
+    /* Find which built-in function to run. */
+    int saved[3] = {-1, -1, -1};
+    /* Prefix assignments last as long as the built-in, in a scope of their own */
+    if (command->assignments_length > 0)
+      vars_push_scope();
+    for (size_t i = 0; status == 0 && i < command->assignments_length; i++)
+      if (vars_assign(&command->assignments[i], true) < 0)
+        status = 1;
+    if (status == 0 && redirects_apply(command, saved) < 0)
+      status = 1;
+    else if (status == 0)
+      status = cmd_table[fundex].fun(command->words);
+    redirects_restore(saved);
+    if (command->assignments_length > 0)
+      vars_pop_scope();
+    metrics_record(cmd_table[fundex].cmd, clock_now_ns() - start);
+  } else if (pipeline->length > 0 && (pipeline->flags & PIPELINE_BACKGROUND)) {
+    struct job *job = job_spawn(pipeline, false, NULL);
+    fprintf(stderr, "[%d] %d\n", job->id, (int) job->processes[0].pid);
+  } else if (pipeline->length > 0) {
+    struct job *job = job_spawn(pipeline, true, NULL);
+    status = job_foreground(job, false);
+    usage = job->usage;
+    if (job_is_completed(job))
+      job_remove(job);
+  }
+
+  if (pipeline->flags & PIPELINE_TIME) {
+    struct rusage self_after;
+    struct timing timing;
+    timing.real_ns = clock_now_ns() - start;
+    getrusage(RUSAGE_SELF, &self_after);
+    timing.user_ns = timeval_ns(usage.ru_utime) +
+        timeval_ns(self_after.ru_utime) - timeval_ns(self_before.ru_utime);
+    timing.sys_ns = timeval_ns(usage.ru_stime) +
+        timeval_ns(self_after.ru_stime) - timeval_ns(self_before.ru_stime);
+    timing_report(&timing, status, pipeline->flags & PIPELINE_TIME_JSON);
+  }
+  if (expanded != NULL) {
+    command->words = words;
+    tokens_destroy(expanded);
+  }
+  return status;
+}
+
+int run_list(struct list *list) {
+  int status = 0;
+  for (size_t i = 0; i < list->length; i++) {
+    int connector = i > 0 ? list->items[i - 1].connector : LIST_SEQUENCE;
+    if ((connector == LIST_AND && status != 0) || (connector == LIST_OR && status == 0))
+      continue;
+    status = run_pipeline(list->items[i].pipeline);
+    vars_set_status(status);
+    /* ^C stops the whole list, not just the command it interrupted */
+    if (status == 128 + SIGINT)
+      break;
+  }
+  return status;
+}
+
+/* Runs one line of input and returns its exit status */
+int run_tokens(struct tokens *tokens) {
+  int status = 1;
+  struct tokens *expanded = alias_expand(tokens);
+  struct list *list = parse_list(expanded ? expanded : tokens);
+  if (list != NULL)
+    status = run_list(list);
+  list_destroy(list);
+  if (expanded != NULL)
+    tokens_destroy(expanded);
+  vars_set_status(status);
+  return status;
+}
+
+int run_line(const char *line) {
+  /* Split our line into words. */
+  struct tokens *tokens = tokenize(line);
+  int status = run_tokens(tokens);
+
+  /* Clean up memory */
+  tokens_destroy(tokens);
+  return status;
+}
+
+/* The pid that writes the snapshot: a child that calls exit() mustn't */
+static pid_t snapshot_pid;
+static const char *snapshot_path;
+
+static void save_snapshot(void) {
+  if (getpid() == snapshot_pid)
+    snapshot_save(snapshot_path);
+}
+
 int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--pool-helper") == 0)
+    pool_helper_main(atoi(argv[2]));
+
+  /* `--restore FILE' starts from a snapshot; `--snapshot FILE' writes one on the way out */
+  int arg = 1;
+  const char *restore_path = NULL;
+  for (; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "--restore") == 0)
+      restore_path = argv[arg + 1];
+    else if (strcmp(argv[arg], "--snapshot") == 0)
+      snapshot_path = argv[arg + 1];
+    else
+      break;
+  }
+  /* The new snapshot starts from the environment as it was before any restore, whichever
+   * option came first, so that it keeps what the restored one set */
+  if (snapshot_path != NULL) {
+    snapshot_begin();
+    snapshot_pid = getpid();
+    atexit(save_snapshot);
+  }
+  if (restore_path != NULL && snapshot_restore(restore_path) < 0)
+    return 1;
+  bool restored = restore_path != NULL;
+
+  /* `shell -c COMMAND' runs a single line without touching the terminal */
+  if (arg + 1 < argc && strcmp(argv[arg], "-c") == 0) {
+    int status = run_line(argv[arg + 1]);
+    fflush(stdout);
+    return status;
+  }
+
   init_shell();
+  evloop_init();
+
+  /* A snapshot already holds what the rc file would set up */
+  if (shell_is_interactive && !restored)
+    rc_load();
 
   static char line[4096];
   int line_num = 0;
@@ -98,26 +402,13 @@ int main(int argc, char *argv[]) {
   if (shell_is_interactive)
     fprintf(stdout, "%d: ", line_num);
 
-  while (fgets(line, 4096, stdin)) {
-    /* Split our line into words. */
-    struct tokens *tokens = tokenize(line);
-
-    /* Find which built-in function to run. */
-    int fundex = lookup(tokens_get_token(tokens, 0));
-
-    if (fundex >= 0) {
-      cmd_table[fundex].fun(tokens);
-    } else {
-      /* REPLACE this to run commands as programs. */
-      fprintf(stdout, "This shell doesn't know how to run programs.\n");
-    }
+  while (evloop_getline(shell_terminal, line, 4096)) {
+    run_line(line);
+    job_notify();
 
     if (shell_is_interactive)
       /* Please only print shell prompts when standard input is not a tty */
       fprintf(stdout, "%d: ", ++line_num);
-
-    /* Clean up memory */
-    tokens_destroy(tokens);
   }
 
   return 0;
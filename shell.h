@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "tokenizer.h"
+
+struct list;
+struct pipeline;
+
+/* Whether the shell is connected to an actual terminal or not. */
+extern bool shell_is_interactive;
+
+/* File descriptor for the shell input */
+extern int shell_terminal;
+
+/* Terminal mode settings for the shell */
+extern struct termios shell_tmodes;
+
+/* Process group id for the shell */
+extern pid_t shell_pgid;
+
+/* Built-in command functions take token array (see parse.h) and return their exit status */
+typedef int cmd_fun_t(struct tokens *tokens);
+
+/* The built-in changes nothing in the shell but variables and the working directory, so a
+ * subshell running it can stay in the shell's own process */
+#define BUILTIN_SUBSHELL_SAFE 0x1
+
+/* Built-in command struct and lookup table */
+typedef struct fun_desc {
+  cmd_fun_t *fun;
+  char *cmd;
+  char *doc;
+  int flags;
+} fun_desc_t;
+
+extern fun_desc_t cmd_table[];
+
+/* Looks up the built-in command, if it exists. */
+int lookup(char cmd[]);
+
+/* Runs a pipeline and returns its exit status */
+int run_pipeline(struct pipeline *pipeline);
+
+/* Runs the pipelines of a list and returns the exit status of the last one that ran */
+int run_list(struct list *list);
+
+/* Parses and runs the words of one line, setting $?; returns its exit status */
+int run_tokens(struct tokens *tokens);
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alias.h"
+#include "snapshot.h"
+#include "strmap.h"
+#include "vars.h"
+
+extern char **environ;
+
+#define SNAPSHOT_MAGIC "SHSNAP\0\0"
+#define SNAPSHOT_VERSION 2
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  /* Bytes in the whole image, header included, so that a truncated file is caught */
+  uint64_t size;
+};
+
+struct snapshot {
+  char *buf;
+  size_t length;
+  size_t capacity;
+  /* Where the length of the open section goes */
+  size_t section;
+};
+
+/* The environment entries the shell started with, as a set of NAME=VALUE strings */
+static struct strmap *initial_environ;
+
+static void snapshot_put(struct snapshot *snapshot, const void *data, size_t n) {
+  if (snapshot->length + n > snapshot->capacity) {
+    snapshot->capacity = (snapshot->length + n) * 2;
+    snapshot->buf = (char *) realloc(snapshot->buf, snapshot->capacity);
+  }
+  memcpy(snapshot->buf + snapshot->length, data, n);
+  snapshot->length += n;
+}
+
+void snapshot_put_u32(struct snapshot *snapshot, uint32_t value) {
+  snapshot_put(snapshot, &value, sizeof(value));
+}
+
+/* Strings keep their NUL, so that they can be used in place once mapped */
+void snapshot_put_string(struct snapshot *snapshot, const char *text) {
+  uint32_t length = strlen(text);
+  snapshot_put_u32(snapshot, length);
+  snapshot_put(snapshot, text, length + 1);
+}
+
+/* A section's length is 64 bits, so that no part of the state is too big to keep */
+static void section_begin(struct snapshot *snapshot, uint32_t tag) {
+  uint64_t length = 0;
+  snapshot_put_u32(snapshot, tag);
+  snapshot->section = snapshot->length;
+  snapshot_put(snapshot, &length, sizeof(length));
+}
+
+static void section_end(struct snapshot *snapshot) {
+  uint64_t length = snapshot->length - snapshot->section - sizeof(uint64_t);
+  memcpy(snapshot->buf + snapshot->section, &length, sizeof(length));
+}
+
+bool snapshot_get_u32(struct snapshot_reader *reader, uint32_t *value) {
+  if ((size_t) (reader->end - reader->p) < sizeof(*value))
+    return false;
+  memcpy(value, reader->p, sizeof(*value));
+  reader->p += sizeof(*value);
+  return true;
+}
+
+const char *snapshot_get_string(struct snapshot_reader *reader) {
+  uint32_t length;
+  if (!snapshot_get_u32(reader, &length) || (size_t) (reader->end - reader->p) <= length ||
+      reader->p[length] != '\0')
+    return NULL;
+  const char *text = reader->p;
+  reader->p += length + 1;
+  return text;
+}
+
+void snapshot_begin(void) {
+  initial_environ = strmap_new();
+  for (char **entry = environ; *entry != NULL; entry++)
+    strmap_put(initial_environ, *entry);
+}
+
+int snapshot_save(const char *path) {
+  struct snapshot snapshot = {0};
+  struct snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, 0};
+  snapshot_put(&snapshot, &header, sizeof(header));
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    section_begin(&snapshot, SNAPSHOT_CWD);
+    snapshot_put_string(&snapshot, cwd);
+    section_end(&snapshot);
+  }
+
+  /* Only the environment's changes are kept, so that a restored shell still gets the
+   * terminal, display and so on of the session it starts in */
+  section_begin(&snapshot, SNAPSHOT_ENV_SET);
+  for (char **entry = environ; *entry != NULL; entry++)
+    if (initial_environ == NULL || strmap_get(initial_environ, *entry) == NULL)
+      snapshot_put_string(&snapshot, *entry);
+  section_end(&snapshot);
+  section_begin(&snapshot, SNAPSHOT_ENV_UNSET);
+  const char *entry;
+  void *value;
+  for (size_t cursor = 0;
+      initial_environ && strmap_next(initial_environ, &cursor, &entry, &value);) {
+    char *name = strndup(entry, strcspn(entry, "="));
+    if (getenv(name) == NULL)
+      snapshot_put_string(&snapshot, name);
+    free(name);
+  }
+  section_end(&snapshot);
+
+  section_begin(&snapshot, SNAPSHOT_VARS);
+  vars_save(&snapshot);
+  section_end(&snapshot);
+  section_begin(&snapshot, SNAPSHOT_ALIASES);
+  alias_save(&snapshot);
+  section_end(&snapshot);
+
+  header.size = snapshot.length;
+  memcpy(snapshot.buf, &header, sizeof(header));
+
+  /* Written aside and renamed into place, so a shell restoring it never sees half an image */
+  char temp[strlen(path) + 8];
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+  int fd = mkostemp(temp, O_CLOEXEC);
+  int result = 0;
+  if (fd < 0 || write(fd, snapshot.buf, snapshot.length) != (ssize_t) snapshot.length ||
+      close(fd) < 0 || rename(temp, path) < 0) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      unlink(temp);
+    result = -1;
+  }
+  free(snapshot.buf);
+  return result;
+}
+
+/* Puts the environment changes from the image in place */
+static void restore_environ(struct snapshot_reader *reader, bool set) {
+  const char *entry;
+  while ((entry = snapshot_get_string(reader)) != NULL) {
+    const char *equals = strchr(entry, '=');
+    if (set && equals == NULL)
+      continue;
+    char *name = strndup(entry, set ? (size_t) (equals - entry) : strlen(entry));
+    vars_setenv(name, set ? equals + 1 : NULL);
+    free(name);
+  }
+}
+
+int snapshot_restore(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  struct snapshot_header header;
+  const char *image = st.st_size >= (off_t) sizeof(header) ?
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (image != MAP_FAILED)
+    memcpy(&header, image, sizeof(header));
+  if (image == MAP_FAILED || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION || header.size != (uint64_t) st.st_size) {
+    fprintf(stderr, "shell: %s: not a snapshot from this shell\n", path);
+    if (image != MAP_FAILED)
+      munmap((void *) image, st.st_size);
+    return -1;
+  }
+
+  struct snapshot_reader image_reader = {image + sizeof(header), image + st.st_size};
+  uint32_t tag;
+  uint64_t length;
+  int result = 0;
+  while (result == 0 && snapshot_get_u32(&image_reader, &tag)) {
+    if ((size_t) (image_reader.end - image_reader.p) < sizeof(length)) {
+      result = -1;
+      break;
+    }
+    memcpy(&length, image_reader.p, sizeof(length));
+    image_reader.p += sizeof(length);
+    if (length > (size_t) (image_reader.end - image_reader.p)) {
+      result = -1;
+      break;
+    }
+    struct snapshot_reader reader = {image_reader.p, image_reader.p + length};
+    image_reader.p += length;
+
+    const char *cwd;
+    switch (tag) {
+    case SNAPSHOT_CWD:
+      if ((cwd = snapshot_get_string(&reader)) != NULL && chdir(cwd) < 0)
+        fprintf(stderr, "shell: %s: %s\n", cwd, strerror(errno));
+      break;
+    case SNAPSHOT_ENV_SET:
+    case SNAPSHOT_ENV_UNSET:
+      restore_environ(&reader, tag == SNAPSHOT_ENV_SET);
+      break;
+    case SNAPSHOT_VARS:
+      result = vars_load(&reader);
+      break;
+    case SNAPSHOT_ALIASES:
+      result = alias_load(&reader);
+      break;
+    }
+  }
+  if (result < 0)
+    fprintf(stderr, "shell: %s: damaged snapshot\n", path);
+  munmap((void *) image, st.st_size);
+  return result;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A snapshot is a binary image of the shell's state, written by `shell --snapshot FILE' when it
+ * exits and loaded by `shell --restore FILE' in place of running the commands that built it.
+ * The image is a header and then sections, each a tag and a byte length, so a reader can skip
+ * those it doesn't know. It is parsed straight out of an mmap()ed file, but the loaders copy
+ * what they keep, since the shell's tables own their strings and free them on change; the
+ * file is unmapped as soon as it has been loaded. */
+
+/* Section tags */
+#define SNAPSHOT_CWD 1
+#define SNAPSHOT_ENV_SET 2
+#define SNAPSHOT_ENV_UNSET 3
+#define SNAPSHOT_VARS 4
+#define SNAPSHOT_ALIASES 5
+
+/* An image being written */
+struct snapshot;
+
+/* Where an image is being read: the rest of the current section */
+struct snapshot_reader {
+  const char *p;
+  const char *end;
+};
+
+/* Remembers the environment the shell started with, so that the image only records what has
+ * changed since; called first thing by `--snapshot' */
+void snapshot_begin(void);
+
+/* Writes the shell's state to path; returns -1 (after a message) if it can't */
+int snapshot_save(const char *path);
+
+/* Loads the state in the image at path; returns -1 (after a message) if it isn't one */
+int snapshot_restore(const char *path);
+
+/* For the modules that save state: add to the current section */
+void snapshot_put_u32(struct snapshot *snapshot, uint32_t value);
+void snapshot_put_string(struct snapshot *snapshot, const char *text);
+
+/* ... and read it back; both fail (false or NULL) once the section runs out. Strings point
+ * into the image, which stays mapped only while it is being restored. */
+bool snapshot_get_u32(struct snapshot_reader *reader, uint32_t *value);
+const char *snapshot_get_string(struct snapshot_reader *reader);
@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "strmap.h"
+
+#define GROUP_SIZE 16
+
+/* Control bytes: a full slot holds the low 7 bits of its key's hash, so only free slots have
+ * the sign bit set */
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+struct slot {
+  char *key;
+  void *value;
+};
+
+struct strmap {
+  /* Keys in the map, and slots that are full or deleted; a lookup can only stop at an empty
+   * slot, so both count towards the load */
+  size_t length;
+  size_t used;
+  /* Number of groups, a power of two */
+  size_t groups;
+  int8_t *ctrl;
+  struct slot *slots;
+};
+
+static uint64_t hash(const char *key) {
+  /* FNV-1a, with a final mix so that the low 7 bits depend on every byte */
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *key; key++)
+    h = (h ^ (unsigned char) *key) * 0x100000001b3ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Bit i of the result is set if control byte i of the group is byte */
+static unsigned group_match(const int8_t *ctrl, int8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++)
+    mask |= (unsigned) (ctrl[i] == byte) << i;
+  return mask;
+#endif
+}
+
+/* Bit i of the result is set if slot i of the group is empty or deleted */
+static unsigned group_match_free(const int8_t *ctrl) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++)
+    mask |= (unsigned) (ctrl[i] < 0) << i;
+  return mask;
+#endif
+}
+
+/* Groups are probed in triangular steps, which visit every group when their number is a power
+ * of two */
+#define FOR_EACH_GROUP(map, h, g, step) \
+  for (size_t g = ((h) >> 7) & ((map)->groups - 1), step = 0; ; \
+      g = (g + ++step) & ((map)->groups - 1))
+
+/* Index of the slot holding key, or -1 */
+static ptrdiff_t find(struct strmap *map, const char *key, uint64_t h) {
+  int8_t h2 = h & 0x7f;
+  FOR_EACH_GROUP(map, h, g, step) {
+    const int8_t *ctrl = map->ctrl + g * GROUP_SIZE;
+    for (unsigned match = group_match(ctrl, h2); match != 0; match &= match - 1) {
+      size_t i = g * GROUP_SIZE + __builtin_ctz(match);
+      if (strcmp(map->slots[i].key, key) == 0)
+        return i;
+    }
+    if (group_match(ctrl, CTRL_EMPTY) != 0)
+      return -1;
+  }
+}
+
+/* Index of the first free slot in key's probe sequence */
+static size_t find_free(struct strmap *map, uint64_t h) {
+  FOR_EACH_GROUP(map, h, g, step) {
+    unsigned match = group_match_free(map->ctrl + g * GROUP_SIZE);
+    if (match != 0)
+      return g * GROUP_SIZE + __builtin_ctz(match);
+  }
+}
+
+static void allocate(struct strmap *map, size_t groups) {
+  map->groups = groups;
+  map->used = map->length;
+  map->ctrl = (int8_t *) malloc(groups * GROUP_SIZE);
+  memset(map->ctrl, CTRL_EMPTY, groups * GROUP_SIZE);
+  map->slots = (struct slot *) malloc(groups * GROUP_SIZE * sizeof(struct slot));
+}
+
+/* Moves every key into a fresh table, which also clears out the deleted slots. The table
+ * doubles when more than half of the load is live keys. */
+static void rehash(struct strmap *map) {
+  size_t old_groups = map->groups;
+  int8_t *old_ctrl = map->ctrl;
+  struct slot *old_slots = map->slots;
+  size_t capacity = old_groups * GROUP_SIZE;
+  allocate(map, map->length * 2 >= capacity * 7 / 8 ? old_groups * 2 : old_groups);
+
+  for (size_t i = 0; i < capacity; i++) {
+    if (old_ctrl[i] < 0)
+      continue;
+    uint64_t h = hash(old_slots[i].key);
+    size_t slot = find_free(map, h);
+    map->ctrl[slot] = h & 0x7f;
+    map->slots[slot] = old_slots[i];
+  }
+  free(old_ctrl);
+  free(old_slots);
+}
+
+struct strmap *strmap_new(void) {
+  struct strmap *map = (struct strmap *) calloc(1, sizeof(struct strmap));
+  allocate(map, 1);
+  return map;
+}
+
+size_t strmap_length(struct strmap *map) {
+  return map->length;
+}
+
+void **strmap_get(struct strmap *map, const char *key) {
+  ptrdiff_t i = find(map, key, hash(key));
+  return i < 0 ? NULL : &map->slots[i].value;
+}
+
+void **strmap_put(struct strmap *map, const char *key) {
+  uint64_t h = hash(key);
+  ptrdiff_t i = find(map, key, h);
+  if (i >= 0)
+    return &map->slots[i].value;
+
+  /* Keep at least one slot in eight empty so that every lookup terminates quickly */
+  if (map->used + 1 > map->groups * GROUP_SIZE * 7 / 8)
+    rehash(map);
+  size_t slot = find_free(map, h);
+  if (map->ctrl[slot] == CTRL_EMPTY)
+    map->used++;
+  map->length++;
+  map->ctrl[slot] = h & 0x7f;
+  map->slots[slot].key = strdup(key);
+  map->slots[slot].value = NULL;
+  return &map->slots[slot].value;
+}
+
+void *strmap_remove(struct strmap *map, const char *key) {
+  ptrdiff_t i = find(map, key, hash(key));
+  if (i < 0)
+    return NULL;
+  void *value = map->slots[i].value;
+  free(map->slots[i].key);
+  map->length--;
+
+  /* A lookup that reaches a group with an empty slot stops there anyway, so the slot can be
+   * emptied outright; otherwise it has to stay in the way as a tombstone */
+  if (group_match(map->ctrl + i / GROUP_SIZE * GROUP_SIZE, CTRL_EMPTY) != 0) {
+    map->ctrl[i] = CTRL_EMPTY;
+    map->used--;
+  } else {
+    map->ctrl[i] = CTRL_DELETED;
+  }
+  return value;
+}
+
+bool strmap_next(struct strmap *map, size_t *cursor, const char **key, void **value) {
+  for (; *cursor < map->groups * GROUP_SIZE; (*cursor)++) {
+    if (map->ctrl[*cursor] >= 0) {
+      *key = map->slots[*cursor].key;
+      *value = map->slots[*cursor].value;
+      (*cursor)++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void strmap_destroy(struct strmap *map, void (*free_value)(void *)) {
+  if (map == NULL)
+    return;
+  for (size_t i = 0; i < map->groups * GROUP_SIZE; i++) {
+    if (map->ctrl[i] < 0)
+      continue;
+    free(map->slots[i].key);
+    if (free_value != NULL && map->slots[i].value != NULL)
+      free_value(map->slots[i].value);
+  }
+  free(map->ctrl);
+  free(map->slots);
+  free(map);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A hash table from strings to pointers. It uses open addressing over groups of 16 slots, with
+ * a control byte per slot holding 7 bits of its key's hash, so a lookup compares a whole group
+ * of control bytes at once (with SSE2 where there is one) and only looks at keys that are
+ * likely to match. */
+struct strmap;
+
+/* Make an empty map */
+struct strmap *strmap_new(void);
+
+/* How many keys are there? */
+size_t strmap_length(struct strmap *map);
+
+/* Get a pointer to the value stored under key, or NULL if there is none */
+void **strmap_get(struct strmap *map, const char *key);
+
+/* Get a pointer to the value stored under key, adding the key with a NULL value if it isn't
+ * there yet. The map keeps its own copy of the key. */
+void **strmap_put(struct strmap *map, const char *key);
+
+/* Remove a key, returning its value (NULL if there was none) */
+void *strmap_remove(struct strmap *map, const char *key);
+
+/* Step through the map: start with *cursor at 0 and call until it returns false. The order is
+ * arbitrary, and the map must not change along the way. */
+bool strmap_next(struct strmap *map, size_t *cursor, const char **key, void **value);
+
+/* Free the memory, passing every value that isn't NULL to free_value (unless that is NULL) */
+void strmap_destroy(struct strmap *map, void (*free_value)(void *));
@@ -0,0 +1,204 @@
+/* Drives an interactive shell through a pseudo-terminal: a job is stopped with ^Z, resumed
+ * with bg and fg and interrupted with ^C, and after each step the test checks which process
+ * group owns the terminal and that the terminal modes are the shell's own while it reads
+ * commands and the job's while the job runs. It then times the terminal hand-off both ways.
+ *
+ *   tests/job_control ./shell [ROUNDS]
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_MS 5000
+
+static int master;
+static pid_t shell_pid;
+static int prompts;
+/* Everything the shell has written since the last prompt */
+static char output[65536];
+static size_t output_length;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fail(const char *what) {
+  fprintf(stderr, "FAIL: %s\n--- output ---\n%.*s\n", what, (int) output_length, output);
+  kill(shell_pid, SIGKILL);
+  exit(1);
+}
+
+static void send(const char *text) {
+  if (write(master, text, strlen(text)) != (ssize_t) strlen(text))
+    fail("write to the terminal");
+}
+
+/* Reads the shell's output until it has printed the next prompt */
+static void expect_prompt(void) {
+  char prompt[32];
+  snprintf(prompt, sizeof(prompt), "%d: ", ++prompts);
+  uint64_t deadline = now_ns() + (uint64_t) TIMEOUT_MS * 1000000;
+  output_length = 0;
+  while (memmem(output, output_length, prompt, strlen(prompt)) == NULL) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    int ms = (int) ((deadline - now_ns()) / 1000000);
+    if (ms <= 0 || poll(&pfd, 1, ms) <= 0)
+      fail(prompt);
+    ssize_t n = read(master, output + output_length, sizeof(output) - output_length - 1);
+    if (n <= 0)
+      fail("the shell went away");
+    output_length += n;
+  }
+}
+
+static void expect_output(const char *text) {
+  if (memmem(output, output_length, text, strlen(text)) == NULL)
+    fail(text);
+}
+
+/* Waits for the terminal's foreground process group to become (or stop being) pgid */
+static void wait_foreground(pid_t pgid, bool is) {
+  uint64_t start = now_ns();
+  while ((tcgetpgrp(master) == pgid) != is) {
+    if (now_ns() - start > (uint64_t) TIMEOUT_MS * 1000000)
+      fail(is ? "the job never got the terminal" : "the shell never got the terminal back");
+    usleep(20);
+  }
+}
+
+static bool echoing(void) {
+  struct termios modes;
+  if (tcgetattr(master, &modes) < 0)
+    fail("tcgetattr");
+  return modes.c_lflag & ECHO;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, uint64_t *times, int rounds) {
+  qsort(times, rounds, sizeof(uint64_t), compare_ns);
+  printf("%s: median %.1f us, p90 %.1f us, max %.1f us over %d rounds\n", what,
+      times[rounds / 2] / 1e3, times[rounds * 9 / 10] / 1e3, times[rounds - 1] / 1e3, rounds);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s SHELL [ROUNDS]\n", argv[0]);
+    return 2;
+  }
+  int rounds = argc > 2 ? atoi(argv[2]) : 100;
+  if (rounds <= 0)
+    rounds = 1;
+
+  shell_pid = forkpty(&master, NULL, NULL, NULL);
+  if (shell_pid < 0) {
+    perror("forkpty");
+    return 1;
+  }
+  if (shell_pid == 0) {
+    setenv("SHELLRC", "/dev/null", 1);
+    execl(argv[1], argv[1], (char *) NULL);
+    perror(argv[1]);
+    _exit(127);
+  }
+  prompts = -1;
+  expect_prompt();
+  if (!echoing())
+    fail("the terminal starts without echo");
+
+  /* A command that changes the modes doesn't leave them changed for the shell */
+  send("stty -echo\n");
+  expect_prompt();
+  if (!echoing())
+    fail("the shell's modes weren't put back after stty -echo");
+
+  /* Stopped with ^Z, the job keeps its own modes, and the shell gets its own back */
+  send("sh -c 'stty -echo; exec sleep 30'\n");
+  wait_foreground(shell_pid, false);
+  pid_t job_pgid = tcgetpgrp(master);
+  usleep(100000);
+  send("\x1a");
+  expect_prompt();
+  wait_foreground(shell_pid, true);
+  if (!echoing())
+    fail("the shell's modes weren't put back when the job stopped");
+  send("jobs\n");
+  expect_prompt();
+  expect_output("Stopped");
+
+  /* bg leaves the terminal with the shell */
+  send("bg\n");
+  expect_prompt();
+  expect_output("&");
+  if (tcgetpgrp(master) != shell_pid)
+    fail("bg gave the job the terminal");
+  send("jobs\n");
+  expect_prompt();
+  expect_output("Running");
+
+  /* fg hands the terminal and the job's modes back to the job */
+  send("fg\n");
+  wait_foreground(job_pgid, true);
+  if (echoing())
+    fail("fg didn't put the job's modes back");
+  send("\x1a");
+  expect_prompt();
+  wait_foreground(shell_pid, true);
+
+  /* Timed round trips: fg until the job owns the terminal, ^Z until the shell does again */
+  uint64_t *fg_times = (uint64_t *) malloc(sizeof(uint64_t) * rounds);
+  uint64_t *stop_times = (uint64_t *) malloc(sizeof(uint64_t) * rounds);
+  for (int i = 0; i < rounds; i++) {
+    /* Timed from before the write, as the shell may well run before write() returns */
+    uint64_t start = now_ns();
+    send("fg\n");
+    wait_foreground(job_pgid, true);
+    fg_times[i] = now_ns() - start;
+    start = now_ns();
+    send("\x1a");
+    wait_foreground(shell_pid, true);
+    stop_times[i] = now_ns() - start;
+    expect_prompt();
+  }
+
+  /* ^C ends the job, and the shell is left with the terminal and its modes */
+  send("fg\n");
+  wait_foreground(job_pgid, true);
+  send("\x03");
+  expect_prompt();
+  wait_foreground(shell_pid, true);
+  if (!echoing())
+    fail("the shell's modes weren't put back when the job was interrupted");
+  send("jobs\n");
+  expect_prompt();
+  if (memmem(output, output_length, "sleep", 5) != NULL)
+    fail("the interrupted job is still listed");
+
+  send("exit\n");
+  int status;
+  waitpid(shell_pid, &status, 0);
+
+  report("fg hand-off", fg_times, rounds);
+  report("^Z hand-back", stop_times, rounds);
+  free(fg_times);
+  free(stop_times);
+  printf("ok\n");
+  return 0;
+}
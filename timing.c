@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "timing.h"
+
+uint64_t clock_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t timeval_ns(struct timeval tv) {
+  return (uint64_t) tv.tv_sec * 1000000000 + (uint64_t) tv.tv_usec * 1000;
+}
+
+static void timeval_add(struct timeval *total, struct timeval tv) {
+  total->tv_sec += tv.tv_sec;
+  total->tv_usec += tv.tv_usec;
+  if (total->tv_usec >= 1000000) {
+    total->tv_sec++;
+    total->tv_usec -= 1000000;
+  }
+}
+
+void rusage_add(struct rusage *total, const struct rusage *usage) {
+  timeval_add(&total->ru_utime, usage->ru_utime);
+  timeval_add(&total->ru_stime, usage->ru_stime);
+}
+
+void timing_report(const struct timing *timing, int status, int json) {
+  if (json) {
+    fprintf(stderr, "{\"real_ns\":%llu,\"user_ns\":%llu,\"sys_ns\":%llu,\"status\":%d}\n",
+        (unsigned long long) timing->real_ns, (unsigned long long) timing->user_ns,
+        (unsigned long long) timing->sys_ns, status);
+    return;
+  }
+  const uint64_t values[] = {timing->real_ns, timing->user_ns, timing->sys_ns};
+  const char *names[] = {"real", "user", "sys"};
+  for (int i = 0; i < 3; i++)
+    fprintf(stderr, "%-4s %llu.%09llu\n", names[i],
+        (unsigned long long) (values[i] / 1000000000),
+        (unsigned long long) (values[i] % 1000000000));
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+/* Wall-clock and CPU time spent running something */
+struct timing {
+  uint64_t real_ns;
+  uint64_t user_ns;
+  uint64_t sys_ns;
+};
+
+/* Nanoseconds on the raw monotonic clock, unaffected by NTP slewing */
+uint64_t clock_now_ns(void);
+
+/* Converts a struct timeval to nanoseconds */
+uint64_t timeval_ns(struct timeval tv);
+
+/* Adds the CPU times in usage to the running totals in total */
+void rusage_add(struct rusage *total, const struct rusage *usage);
+
+/* Prints a timing report to stderr, as text or as a JSON object */
+void timing_report(const struct timing *timing, int status, int json);
@@ -1,4 +1,6 @@
 #include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "tokenizer.h"
@@ -8,6 +10,25 @@ struct tokens {
   char **tokens;
   size_t buffers_length;
   char **buffers;
+  bool *operators;
+  /* The words point into buffers rather than being allocated one by one */
+  bool words_in_buffers;
+};
+
+/* Unquoted operators that are split into words of their own, longest first */
+static const char *operators[] = {">>", "<(", ">(", "&&", "||", "|", "&", ";", "<", ">", "(", ")",
+    NULL};
+
+/* The words are stored right after the offset table; offsets are relative to the start of the
+ * block, so a copy of the block is valid wherever it lands. The top bit of an offset marks an
+ * operator. */
+#define FLAT_OPERATOR 0x80000000u
+#define FLAT_OFFSET(offset) ((offset) & ~FLAT_OPERATOR)
+
+struct flat_tokens {
+  uint32_t size;
+  uint32_t length;
+  uint32_t offsets[];
 };
 
 static void *vector_push(char ***pointer, size_t *size, void *elem) {
@@ -24,6 +45,38 @@ static void *copy_word(char *source, size_t n) {
   return word;
 }
 
+static void push_word(struct tokens *tokens, char *word, bool operator) {
+  tokens->operators = (bool *) realloc(tokens->operators,
+      sizeof(bool) * (tokens->tokens_length + 1));
+  tokens->operators[tokens->tokens_length] = operator;
+  if (tokens->words_in_buffers)
+    vector_push(&tokens->buffers, &tokens->buffers_length, word);
+  vector_push(&tokens->tokens, &tokens->tokens_length, word);
+}
+
+/* Returns the operator starting at s, if any */
+static const char *match_operator(const char *s) {
+  for (int i = 0; operators[i] != NULL; i++)
+    if (strncmp(s, operators[i], strlen(operators[i])) == 0)
+      return operators[i];
+  return NULL;
+}
+
+struct tokens *tokens_new(void) {
+  struct tokens *tokens = (struct tokens *) malloc(sizeof(struct tokens));
+  tokens->tokens_length = 0;
+  tokens->tokens = NULL;
+  tokens->buffers_length = 0;
+  tokens->buffers = NULL;
+  tokens->operators = NULL;
+  tokens->words_in_buffers = false;
+  return tokens;
+}
+
+void tokens_append(struct tokens *tokens, const char *word, bool operator) {
+  push_word(tokens, strdup(word), operator);
+}
+
 struct tokens *tokenize(const char *line) {
   if (line == NULL) {
     return NULL;
@@ -31,19 +84,16 @@ struct tokens *tokenize(const char *line) {
 
   static char token[4096];
   size_t n = 0, n_max = 4096;
-  struct tokens *tokens;
+  struct tokens *tokens = tokens_new();
   size_t line_length = strlen(line);
-
-  tokens = (struct tokens *) malloc(sizeof(struct tokens));
-  tokens->tokens_length = 0;
-  tokens->tokens = NULL;
-  tokens->buffers_length = 0;
-  tokens->buffers = NULL;
+  const char *operator;
 
   const int MODE_NORMAL = 0,
         MODE_SQUOTE = 1,
         MODE_DQUOTE = 2;
   int mode = MODE_NORMAL;
+  /* Inside ${...}, spaces and operators are part of the word */
+  int braces = 0;
 
   for (int i = 0; i < line_length; i++) {
     char c = line[i];
@@ -56,12 +106,29 @@ struct tokens *tokenize(const char *line) {
         if (i + 1 < line_length) {
           token[n++] = line[++i];
         }
+      } else if (c == '$') {
+        token[n++] = TOKEN_EXPAND;
+        if (i + 1 < line_length && line[i + 1] == '{')
+          token[n++] = line[++i], braces++;
+      } else if (c == '#' && n == 0 && braces == 0) {
+        /* A comment runs to the end of the line */
+        break;
+      } else if (braces > 0) {
+        if (c == '}')
+          braces--;
+        token[n++] = c;
       } else if (isspace(c)) {
         if (n > 0) {
-          void *word = copy_word(token, n);
-          vector_push(&tokens->tokens, &tokens->tokens_length, word);
+          push_word(tokens, copy_word(token, n), false);
           n = 0;
         }
+      } else if ((operator = match_operator(line + i)) != NULL) {
+        if (n > 0) {
+          push_word(tokens, copy_word(token, n), false);
+          n = 0;
+        }
+        push_word(tokens, strdup(operator), true);
+        i += strlen(operator) - 1;
       } else {
         token[n++] = c;
       }
@@ -78,6 +145,8 @@ struct tokens *tokenize(const char *line) {
     } else if (mode == MODE_DQUOTE) {
       if (c == '"') {
         mode = MODE_NORMAL;
+      } else if (c == '$') {
+        token[n++] = TOKEN_EXPAND;
       } else if (c == '\\') {
         if (i + 1 < line_length) {
           token[n++] = line[++i];
@@ -90,8 +159,7 @@ struct tokens *tokenize(const char *line) {
   }
 
   if (n > 0) {
-    void *word = copy_word(token, n);
-    vector_push(&tokens->tokens, &tokens->tokens_length, word);
+    push_word(tokens, copy_word(token, n), false);
     n = 0;
   }
   return tokens;
@@ -113,15 +181,131 @@ char *tokens_get_token(struct tokens *tokens, size_t n) {
   }
 }
 
+bool tokens_is_operator(struct tokens *tokens, size_t n) {
+  if (tokens == NULL || n >= tokens->tokens_length) {
+    return false;
+  } else {
+    return tokens->operators[n];
+  }
+}
+
+bool tokens_match(struct tokens *tokens, size_t n, const char *operator) {
+  return tokens_is_operator(tokens, n) && strcmp(tokens->tokens[n], operator) == 0;
+}
+
 void tokens_destroy(struct tokens *tokens) {
   if (tokens == NULL) {
     return;
   }
-  for (int i = 0; i < tokens->tokens_length; i++) {
+  for (int i = 0; i < tokens->tokens_length && !tokens->words_in_buffers; i++) {
     free(tokens->tokens[i]);
   }
   for (int i = 0; i < tokens->buffers_length; i++) {
     free(tokens->buffers[i]);
   }
+  free(tokens->tokens);
+  free(tokens->buffers);
+  free(tokens->operators);
   free(tokens);
 }
+
+struct flat_tokens *tokens_flatten(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  size_t size = sizeof(struct flat_tokens) + sizeof(uint32_t) * length;
+  for (size_t i = 0; i < length; i++) {
+    size += strlen(tokens->tokens[i]) + 1;
+  }
+  if (size > FLAT_OPERATOR) {
+    return NULL;
+  }
+
+  struct flat_tokens *flat = (struct flat_tokens *) malloc(size);
+  if (flat == NULL) {
+    return NULL;
+  }
+  flat->size = size;
+  flat->length = length;
+
+  char *base = (char *) flat;
+  size_t offset = sizeof(struct flat_tokens) + sizeof(uint32_t) * length;
+  for (size_t i = 0; i < length; i++) {
+    size_t n = strlen(tokens->tokens[i]) + 1;
+    memcpy(base + offset, tokens->tokens[i], n);
+    flat->offsets[i] = offset | (tokens->operators[i] ? FLAT_OPERATOR : 0);
+    offset += n;
+  }
+  return flat;
+}
+
+size_t flat_tokens_size(struct flat_tokens *flat) {
+  return flat == NULL ? 0 : flat->size;
+}
+
+size_t flat_tokens_get_length(struct flat_tokens *flat) {
+  return flat == NULL ? 0 : flat->length;
+}
+
+char *flat_tokens_get_token(struct flat_tokens *flat, size_t n) {
+  if (flat == NULL || n >= flat->length) {
+    return NULL;
+  } else {
+    return (char *) flat + FLAT_OFFSET(flat->offsets[n]);
+  }
+}
+
+char **flat_tokens_argv(struct flat_tokens *flat, char **argv) {
+  size_t length = flat_tokens_get_length(flat);
+  for (size_t i = 0; i < length; i++) {
+    argv[i] = (char *) flat + FLAT_OFFSET(flat->offsets[i]);
+  }
+  argv[length] = NULL;
+  return argv;
+}
+
+struct flat_tokens *flat_tokens_copy(struct flat_tokens *flat) {
+  if (flat == NULL) {
+    return NULL;
+  }
+  struct flat_tokens *copy = (struct flat_tokens *) malloc(flat->size);
+  if (copy != NULL) {
+    memcpy(copy, flat, flat->size);
+  }
+  return copy;
+}
+
+bool flat_tokens_check(const void *block, size_t size) {
+  const struct flat_tokens *flat = (const struct flat_tokens *) block;
+  if (size < sizeof(struct flat_tokens) || flat->size > size ||
+      flat->size < sizeof(struct flat_tokens) ||
+      flat->length > (flat->size - sizeof(struct flat_tokens)) / sizeof(uint32_t))
+    return false;
+  size_t start = sizeof(struct flat_tokens) + sizeof(uint32_t) * flat->length;
+  for (size_t i = 0; i < flat->length; i++) {
+    size_t offset = FLAT_OFFSET(flat->offsets[i]);
+    if (offset < start || offset >= flat->size ||
+        memchr((const char *) block + offset, '\0', flat->size - offset) == NULL)
+      return false;
+  }
+  return true;
+}
+
+struct tokens *flat_tokens_unflatten(struct flat_tokens *flat) {
+  /* One copy of the block holds every word, instead of an allocation per word */
+  struct tokens *tokens = tokens_new();
+  struct flat_tokens *copy = flat_tokens_copy(flat);
+  size_t length = flat_tokens_get_length(copy);
+  tokens->tokens_length = length;
+  tokens->tokens = (char **) malloc(sizeof(char *) * (length + 1));
+  tokens->operators = (bool *) malloc(sizeof(bool) * (length + 1));
+  for (size_t i = 0; i < length; i++) {
+    tokens->tokens[i] = flat_tokens_get_token(copy, i);
+    tokens->operators[i] = copy->offsets[i] & FLAT_OPERATOR;
+  }
+  vector_push(&tokens->buffers, &tokens->buffers_length, copy);
+  tokens->words_in_buffers = true;
+  return tokens;
+}
+
+void flat_tokens_destroy(struct flat_tokens *flat) {
+  free(flat);
+}
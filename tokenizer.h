@@ -1,9 +1,15 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Stands in for a `$' that starts an expansion, as opposed to one that was quoted or escaped */
+#define TOKEN_EXPAND '\001'
+
 /* A struct that represents a list of words. */
 struct tokens;
 
-/* Turn a string into a list of words. */
+/* Turn a string into a list of words. A `#' at the start of a word begins a comment. */
 struct tokens *tokenize(const char *line);
 
 /* How many words are there? */
@@ -12,5 +18,51 @@ size_t tokens_get_length(struct tokens *tokens);
 /* Get me the Nth word (zero-indexed) */
 char *tokens_get_token(struct tokens *tokens, size_t n);
 
+/* Is the Nth word an unquoted operator such as "|" or ">"? */
+bool tokens_is_operator(struct tokens *tokens, size_t n);
+
+/* Is the Nth word the given unquoted operator? */
+bool tokens_match(struct tokens *tokens, size_t n, const char *operator);
+
+/* Make an empty list of words */
+struct tokens *tokens_new(void);
+
+/* Add a copy of a word to the end of the list */
+void tokens_append(struct tokens *tokens, const char *word, bool operator);
+
 /* Free the memory */
 void tokens_destroy(struct tokens *tokens);
+
+/* A flat copy of a list of words: one block holding an offset table followed by the
+ * NUL-terminated words themselves, operators marked as such. It can be copied or written out
+ * with a single memcpy. */
+struct flat_tokens;
+
+/* Flatten a list of words into a single allocation */
+struct flat_tokens *tokens_flatten(struct tokens *tokens);
+
+/* Size in bytes of the whole flat block */
+size_t flat_tokens_size(struct flat_tokens *flat);
+
+/* How many words are there? */
+size_t flat_tokens_get_length(struct flat_tokens *flat);
+
+/* Get me the Nth word (zero-indexed) */
+char *flat_tokens_get_token(struct flat_tokens *flat, size_t n);
+
+/* Fill argv (which must have room for length + 1 pointers) with pointers into the flat block,
+ * NULL-terminated, so it can be handed straight to execv() */
+char **flat_tokens_argv(struct flat_tokens *flat, char **argv);
+
+/* Duplicate a flat block */
+struct flat_tokens *flat_tokens_copy(struct flat_tokens *flat);
+
+/* Is block, of size bytes, a whole flat block that is safe to read (one read back from a
+ * file, say)? */
+bool flat_tokens_check(const void *block, size_t size);
+
+/* Turn a flat block back into a list of words */
+struct tokens *flat_tokens_unflatten(struct flat_tokens *flat);
+
+/* Free the memory */
+void flat_tokens_destroy(struct flat_tokens *flat);
@@ -0,0 +1,857 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "strmap.h"
+#include "vars.h"
+
+/* Indexed arrays are dense, so keep a typo from allocating gigabytes */
+#define MAX_INDEX (1 << 24)
+
+struct var {
+  enum var_kind kind;
+  /* VAR_SCALAR */
+  char *value;
+  /* VAR_INDEXED: values by index, NULL where unset */
+  char **items;
+  size_t length;
+  size_t capacity;
+  /* VAR_ASSOC */
+  struct strmap *map;
+  /* An array copied up into a scope keeps the variable below as its base, and only the
+   * elements changed in the scope (ELEMENT_UNSET for those unset there) in changes, keyed like
+   * an associative array's; length is still its own. items and map are unused. */
+  struct var *base;
+  struct strmap *changes;
+};
+
+static char element_unset[1];
+#define ELEMENT_UNSET element_unset
+
+/* Stands in for a variable unset in a scope, hiding the one below */
+#define VAR_UNSET ((enum var_kind) -1)
+
+/* A scope holds the variables set since it was pushed, over those of the scope below it.
+ * Pushing one copies nothing; a variable is copied up into the top scope the first time it
+ * changes there, and for an array only the elements that change are. */
+struct scope {
+  struct scope *parent;
+  struct strmap *vars;
+  /* Environment variables changed in this scope and their old values (NULL if unset) */
+  struct strmap *environ;
+};
+
+static struct scope global;
+static struct scope *top = &global;
+static int last_status;
+
+/* Finds a variable in the top scope only */
+static struct var *var_find_local(const char *name) {
+  void **slot = top->vars ? strmap_get(top->vars, name) : NULL;
+  return slot ? (struct var *) *slot : NULL;
+}
+
+static struct var *var_find(const char *name) {
+  for (struct scope *scope = top; scope != NULL; scope = scope->parent) {
+    void **slot = scope->vars ? strmap_get(scope->vars, name) : NULL;
+    if (slot != NULL)
+      return ((struct var *) *slot)->kind == VAR_UNSET ? NULL : (struct var *) *slot;
+  }
+  return NULL;
+}
+
+static void element_free(void *data) {
+  if (data != ELEMENT_UNSET)
+    free(data);
+}
+
+static void var_free(void *data) {
+  struct var *var = (struct var *) data;
+  free(var->value);
+  for (size_t i = 0; var->items && i < var->length; i++)
+    free(var->items[i]);
+  free(var->items);
+  strmap_destroy(var->map, free);
+  strmap_destroy(var->changes, element_free);
+  free(var);
+}
+
+/* Makes a new, empty variable in the top scope, replacing any that is there */
+static struct var *var_new(const char *name, enum var_kind kind) {
+  if (top->vars == NULL)
+    top->vars = strmap_new();
+  struct var *var = (struct var *) calloc(1, sizeof(struct var));
+  var->kind = kind;
+  if (kind == VAR_ASSOC)
+    var->map = strmap_new();
+  void **slot = strmap_put(top->vars, name);
+  if (*slot != NULL)
+    var_free(*slot);
+  *slot = var;
+  return var;
+}
+
+/* Finds a variable to change, copying it up into the top scope if it lives further down */
+static struct var *var_find_writable(const char *name) {
+  struct var *var = var_find_local(name);
+  if (var != NULL)
+    return var->kind == VAR_UNSET ? NULL : var;
+  struct var *below = var_find(name);
+  if (below == NULL)
+    return NULL;
+
+  var = var_new(name, below->kind);
+  if (below->kind == VAR_SCALAR) {
+    var->value = below->value ? strdup(below->value) : NULL;
+    return var;
+  }
+  /* An array starts out empty over the one below, however big that is */
+  strmap_destroy(var->map, free);
+  var->map = NULL;
+  var->base = below;
+  var->changes = strmap_new();
+  var->length = below->length;
+  return var;
+}
+
+/* Element key of an array, index being its position in an indexed one; looks through the
+ * changes of the scopes above the variable's own */
+static const char *var_element(struct var *var, const char *key, size_t index) {
+  for (; var->base != NULL; var = var->base) {
+    void **slot = strmap_get(var->changes, key);
+    if (slot != NULL)
+      return *slot == ELEMENT_UNSET ? NULL : (const char *) *slot;
+  }
+  if (var->kind == VAR_ASSOC) {
+    void **slot = strmap_get(var->map, key);
+    return slot ? (const char *) *slot : NULL;
+  }
+  return index < var->length ? var->items[index] : NULL;
+}
+
+/* Records a change to an element of an array copied up into a scope */
+static void var_change(struct var *var, const char *key, const char *value) {
+  void **slot = strmap_put(var->changes, key);
+  element_free(*slot);
+  *slot = value ? strdup(value) : ELEMENT_UNSET;
+}
+
+/* The position of key in an indexed array, negative keys counting back from the end; -1 if it
+ * isn't a valid index */
+static ssize_t var_index(struct var *var, const char *key) {
+  char *end;
+  errno = 0;
+  long long index = strtoll(key, &end, 10);
+  if (end == key || *end != '\0' || errno != 0)
+    return -1;
+  if (index < 0)
+    index += var->length;
+  return index >= 0 && index < MAX_INDEX ? index : -1;
+}
+
+/* Sets element key of an array */
+static int var_set_element(struct var *var, const char *key, const char *value) {
+  if (var->kind == VAR_ASSOC && var->base != NULL) {
+    var_change(var, key, value);
+    return 0;
+  }
+  if (var->kind == VAR_ASSOC) {
+    void **slot = strmap_put(var->map, key);
+    free(*slot);
+    *slot = strdup(value);
+    return 0;
+  }
+
+  ssize_t index = var_index(var, key);
+  if (index < 0) {
+    fprintf(stderr, "shell: %s: bad array subscript\n", key);
+    return -1;
+  }
+  if (var->base != NULL) {
+    char position[24];
+    snprintf(position, sizeof(position), "%zd", index);
+    var_change(var, position, value);
+    if ((size_t) index >= var->length)
+      var->length = index + 1;
+    return 0;
+  }
+  if ((size_t) index >= var->capacity) {
+    size_t capacity = var->capacity ? var->capacity : 8;
+    while (capacity <= (size_t) index)
+      capacity *= 2;
+    var->items = (char **) realloc(var->items, capacity * sizeof(char *));
+    memset(var->items + var->capacity, 0, (capacity - var->capacity) * sizeof(char *));
+    var->capacity = capacity;
+  }
+  if ((size_t) index >= var->length)
+    var->length = index + 1;
+  free(var->items[index]);
+  var->items[index] = strdup(value);
+  return 0;
+}
+
+int vars_declare(const char *name, enum var_kind kind) {
+  struct var *var = var_find_writable(name);
+  if (var == NULL) {
+    var_new(name, kind);
+    return 0;
+  }
+  if (var->kind == kind || kind == VAR_SCALAR)
+    return 0;
+  if (var->kind != VAR_SCALAR) {
+    fprintf(stderr, "shell: %s: cannot convert %s array\n", name,
+        var->kind == VAR_ASSOC ? "associative" : "indexed");
+    return -1;
+  }
+
+  char *value = var->value;
+  var->value = NULL;
+  var->kind = kind;
+  if (kind == VAR_ASSOC)
+    var->map = strmap_new();
+  if (value != NULL)
+    var_set_element(var, "0", value);
+  free(value);
+  return 0;
+}
+
+const char *vars_get(const char *name, const char *key) {
+  struct var *var = var_find(name);
+  bool first = key == NULL || strcmp(key, "0") == 0;
+  if (var == NULL)
+    return first ? getenv(name) : NULL;
+  if (var->kind == VAR_SCALAR)
+    return first ? var->value : NULL;
+  if (var->kind == VAR_ASSOC)
+    return var_element(var, key ? key : "0", 0);
+  ssize_t index = var_index(var, key ? key : "0");
+  if (index < 0 || (size_t) index >= var->length)
+    return NULL;
+  char position[24];
+  snprintf(position, sizeof(position), "%zd", index);
+  return var_element(var, position, index);
+}
+
+int vars_set(const char *name, const char *key, const char *value) {
+  struct var *var = var_find_writable(name);
+  if (var == NULL)
+    var = var_new(name, key == NULL ? VAR_SCALAR : VAR_INDEXED);
+  if (var->kind == VAR_SCALAR && key != NULL && strcmp(key, "0") != 0)
+    vars_declare(name, VAR_INDEXED);
+  if (var->kind == VAR_SCALAR) {
+    free(var->value);
+    var->value = strdup(value);
+    return 0;
+  }
+  return var_set_element(var, key ? key : "0", value);
+}
+
+void vars_setenv(const char *name, const char *value) {
+  if (top != &global) {
+    if (top->environ == NULL)
+      top->environ = strmap_new();
+    if (strmap_get(top->environ, name) == NULL) {
+      const char *old = getenv(name);
+      *strmap_put(top->environ, name) = old ? strdup(old) : NULL;
+    }
+  }
+  if (value != NULL)
+    setenv(name, value, 1);
+  else
+    unsetenv(name);
+}
+
+void vars_unset(const char *name, const char *key) {
+  if (key == NULL) {
+    struct var *var = var_find_local(name);
+    if (var != NULL)
+      var_free(strmap_remove(top->vars, name));
+    /* A scope only hides what is below it */
+    if (top != &global && var_find(name) != NULL)
+      var_new(name, VAR_UNSET);
+    vars_setenv(name, NULL);
+    return;
+  }
+
+  struct var *var = var_find_writable(name);
+  if (var == NULL || var->kind == VAR_SCALAR) {
+    if (strcmp(key, "0") == 0)
+      vars_unset(name, NULL);
+    return;
+  }
+  if (var->kind == VAR_ASSOC && var->base != NULL) {
+    var_change(var, key, NULL);
+    return;
+  }
+  if (var->kind == VAR_ASSOC) {
+    free(strmap_remove(var->map, key));
+    return;
+  }
+  ssize_t index = var_index(var, key);
+  if (index < 0 || (size_t) index >= var->length)
+    return;
+  if (var->base == NULL) {
+    free(var->items[index]);
+    var->items[index] = NULL;
+    while (var->length > 0 && var->items[var->length - 1] == NULL)
+      var->length--;
+    return;
+  }
+  char position[24];
+  snprintf(position, sizeof(position), "%zd", index);
+  var_change(var, position, NULL);
+  for (; var->length > 0; var->length--) {
+    snprintf(position, sizeof(position), "%zu", var->length - 1);
+    if (var_element(var, position, var->length - 1) != NULL)
+      break;
+  }
+}
+
+void vars_push_scope(void) {
+  struct scope *scope = (struct scope *) calloc(1, sizeof(struct scope));
+  scope->parent = top;
+  top = scope;
+}
+
+void vars_pop_scope(void) {
+  if (top == &global)
+    return;
+  struct scope *scope = top;
+  const char *name;
+  void *value;
+  for (size_t cursor = 0; scope->environ && strmap_next(scope->environ, &cursor, &name, &value);)
+    if (value != NULL)
+      setenv(name, (const char *) value, 1);
+    else
+      unsetenv(name);
+  strmap_destroy(scope->environ, free);
+  strmap_destroy(scope->vars, var_free);
+  top = scope->parent;
+  free(scope);
+}
+
+void vars_set_status(int status) {
+  last_status = status;
+}
+
+/* Assigns NAME=(VALUE...): values are appended at the next index, unless they are [KEY]=VALUE */
+static int assign_array(const struct assignment *assignment) {
+  struct var *var = var_find(assignment->name);
+  var = var_new(assignment->name, var && var->kind == VAR_ASSOC ? VAR_ASSOC : VAR_INDEXED);
+
+  int result = 0;
+  size_t next = 0;
+  for (size_t i = 0; i < tokens_get_length(assignment->values); i++) {
+    char *item = tokens_get_token(assignment->values, i);
+    char *close = item[0] == '[' ? strstr(item, "]=") : NULL;
+    char *key = close ? strndup(item + 1, close - item - 1) : NULL;
+    if (key != NULL) {
+      char *expanded = vars_expand(key);
+      free(key);
+      key = expanded;
+    }
+    char *value = vars_expand(close ? close + 2 : item);
+    if (key == NULL && var->kind == VAR_ASSOC) {
+      fprintf(stderr, "shell: %s: %s: must use subscript when assigning associative array\n",
+          assignment->name, value);
+      result = -1;
+    } else if (key == NULL) {
+      char index[24];
+      snprintf(index, sizeof(index), "%zu", next);
+      result |= var_set_element(var, index, value);
+    } else {
+      result |= var_set_element(var, key, value);
+      ssize_t index = var->kind == VAR_INDEXED ? var_index(var, key) : -1;
+      if (index >= 0)
+        next = index;
+    }
+    next++;
+    free(key);
+    free(value);
+  }
+  return result;
+}
+
+int vars_assign(const struct assignment *assignment, bool export) {
+  if (assignment->array)
+    return assign_array(assignment);
+
+  char *key = assignment->key ? vars_expand(assignment->key) : NULL;
+  char *value = vars_expand(tokens_get_token(assignment->values, 0));
+  int result = vars_set(assignment->name, key, value);
+  /* A name the environment already has (PATH, say) is the one commands and lookups see */
+  if (key == NULL && (export || getenv(assignment->name) != NULL))
+    vars_setenv(assignment->name, value);
+  free(key);
+  free(value);
+  return result;
+}
+
+int vars_assign_text(const char *name, const char *value) {
+  int result = vars_set(name, NULL, value);
+  if (result == 0 && getenv(name) != NULL)
+    vars_setenv(name, value);
+  return result;
+}
+
+struct buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void buffer_append(struct buffer *buffer, const char *text, size_t n) {
+  if (buffer->length + n + 1 > buffer->capacity) {
+    buffer->capacity = (buffer->length + n + 1) * 2;
+    buffer->data = (char *) realloc(buffer->data, buffer->capacity);
+  }
+  memcpy(buffer->data + buffer->length, text, n);
+  buffer->length += n;
+  buffer->data[buffer->length] = '\0';
+}
+
+typedef void element_fn(const char *text, void *data);
+
+/* Calls fn with every value (or key) of a variable, in index order for indexed arrays */
+static void var_each(const char *name, bool keys, element_fn *fn, void *data) {
+  struct var *var = var_find(name);
+  if (var == NULL || var->kind == VAR_SCALAR) {
+    const char *value = vars_get(name, NULL);
+    if (value != NULL)
+      fn(keys ? "0" : value, data);
+  } else if (var->kind == VAR_INDEXED) {
+    for (size_t i = 0; i < var->length; i++) {
+      char index[24];
+      snprintf(index, sizeof(index), "%zu", i);
+      const char *value = var_element(var, index, i);
+      if (value != NULL)
+        fn(keys ? index : value, data);
+    }
+  } else {
+    /* Each level's elements, but for those a level above changed */
+    for (struct var *level = var; level != NULL; level = level->base) {
+      struct strmap *map = level->base ? level->changes : level->map;
+      const char *key;
+      void *value;
+      for (size_t cursor = 0; strmap_next(map, &cursor, &key, &value);) {
+        bool hidden = value == ELEMENT_UNSET;
+        for (struct var *above = var; !hidden && above != level; above = above->base)
+          hidden = strmap_get(above->changes, key) != NULL;
+        if (!hidden)
+          fn(keys ? key : (const char *) value, data);
+      }
+    }
+  }
+}
+
+static void count_element(const char *text, void *data) {
+  (*(size_t *) data)++;
+}
+
+/* Appends an element to a buffer, after a space unless it is the first one */
+struct joined {
+  struct buffer *buffer;
+  bool first;
+};
+
+static void join_element(const char *text, void *data) {
+  struct joined *joined = (struct joined *) data;
+  if (!joined->first)
+    buffer_append(joined->buffer, " ", 1);
+  buffer_append(joined->buffer, text, strlen(text));
+  joined->first = false;
+}
+
+/* Expands the inside of ${...}: an optional # (length) or ! (keys), a name and an optional
+ * [subscript], where @ and * stand for every element */
+static void expand_braces(const char *inner, struct buffer *out) {
+  char prefix = inner[0] == '#' || inner[0] == '!' ? inner[0] : '\0';
+  const char *name = prefix && inner[1] != '\0' ? inner + 1 : inner;
+  size_t name_length = 0, length = strlen(name);
+  while (isalnum((unsigned char) name[name_length]) || name[name_length] == '_')
+    name_length++;
+
+  char number[24];
+  if (strcmp(inner, "?") == 0 || strcmp(inner, "#?") == 0) {
+    snprintf(number, sizeof(number), "%d", last_status);
+    buffer_append(out, number, strlen(number));
+    return;
+  }
+  bool subscript = name_length < length && name[name_length] == '[' && name[length - 1] == ']';
+  if (!is_name(name, name_length) || (name_length < length && !subscript) ||
+      (prefix == '!' && !subscript)) {
+    fprintf(stderr, "shell: ${%s}: bad substitution\n", inner);
+    return;
+  }
+
+  char *var_name = strndup(name, name_length);
+  char *key = subscript ? strndup(name + name_length + 1, length - name_length - 2) : NULL;
+  if (key != NULL && (strcmp(key, "@") == 0 || strcmp(key, "*") == 0)) {
+    if (prefix == '#') {
+      size_t count = 0;
+      var_each(var_name, false, count_element, &count);
+      snprintf(number, sizeof(number), "%zu", count);
+      buffer_append(out, number, strlen(number));
+    } else {
+      struct joined joined = {out, true};
+      var_each(var_name, prefix == '!', join_element, &joined);
+    }
+  } else {
+    char *expanded_key = key ? vars_expand(key) : NULL;
+    const char *value = vars_get(var_name, expanded_key);
+    if (prefix == '#') {
+      snprintf(number, sizeof(number), "%zu", value ? strlen(value) : 0);
+      buffer_append(out, number, strlen(number));
+    } else if (value != NULL) {
+      buffer_append(out, value, strlen(value));
+    }
+    free(expanded_key);
+  }
+  free(var_name);
+  free(key);
+}
+
+/* Expands the reference that starts at p, just after a TOKEN_EXPAND, and returns where the
+ * rest of the word starts. Something that isn't a reference leaves the `$' as it was. */
+static const char *expand_reference(const char *p, struct buffer *out) {
+  if (*p == '?') {
+    char number[24];
+    snprintf(number, sizeof(number), "%d", last_status);
+    buffer_append(out, number, strlen(number));
+    return p + 1;
+  }
+
+  if (*p != '{') {
+    size_t n = 0;
+    while (isalnum((unsigned char) p[n]) || p[n] == '_')
+      n++;
+    if (!is_name(p, n)) {
+      buffer_append(out, "$", 1);
+      return p;
+    }
+    char *name = strndup(p, n);
+    const char *value = vars_get(name, NULL);
+    if (value != NULL)
+      buffer_append(out, value, strlen(value));
+    free(name);
+    return p + n;
+  }
+
+  /* Find the matching brace; nested references such as ${a[${b}]} have their own */
+  const char *end = p + 1;
+  for (int depth = 1; *end != '\0'; end++) {
+    if (*end == '{' && end[-1] == TOKEN_EXPAND)
+      depth++;
+    else if (*end == '}' && --depth == 0)
+      break;
+  }
+  if (*end == '\0') {
+    buffer_append(out, "$", 1);
+    return p;
+  }
+  char *inner = strndup(p + 1, end - p - 1);
+  expand_braces(inner, out);
+  free(inner);
+  return end + 1;
+}
+
+char *vars_expand(const char *word) {
+  struct buffer out = {NULL, 0, 0};
+  buffer_append(&out, "", 0);
+  for (const char *p = word; *p != '\0';) {
+    const char *mark = strchr(p, TOKEN_EXPAND);
+    buffer_append(&out, p, mark ? (size_t) (mark - p) : strlen(p));
+    if (mark == NULL)
+      break;
+    p = expand_reference(mark + 1, &out);
+  }
+  return out.data;
+}
+
+static void append_word(const char *text, void *data) {
+  tokens_append((struct tokens *) data, text, false);
+}
+
+/* Expands a word that is exactly ${NAME[@]} or ${!NAME[@]} into one word per element;
+ * returns false if it is something else */
+static bool expand_list(const char *word, struct tokens *expanded) {
+  size_t length = strlen(word);
+  if (length < 6 || word[0] != TOKEN_EXPAND || word[1] != '{' ||
+      (strcmp(word + length - 4, "[@]}") != 0 && strcmp(word + length - 4, "[*]}") != 0))
+    return false;
+  bool keys = word[2] == '!';
+  const char *name = word + 2 + keys;
+  size_t name_length = word + length - 4 - name;
+  if (!is_name(name, name_length))
+    return false;
+  char *var_name = strndup(name, name_length);
+  var_each(var_name, keys, append_word, expanded);
+  free(var_name);
+  return true;
+}
+
+struct tokens *vars_expand_words(struct tokens *words) {
+  size_t length = tokens_get_length(words), i = 0;
+  while (i < length && strchr(tokens_get_token(words, i), TOKEN_EXPAND) == NULL)
+    i++;
+  if (i == length)
+    return NULL;
+
+  struct tokens *expanded = tokens_new();
+  for (i = 0; i < length; i++) {
+    char *word = tokens_get_token(words, i);
+    if (strchr(word, TOKEN_EXPAND) == NULL) {
+      tokens_append(expanded, word, false);
+    } else if (!expand_list(word, expanded)) {
+      char *value = vars_expand(word);
+      tokens_append(expanded, value, false);
+      free(value);
+    }
+  }
+  return expanded;
+}
+
+void vars_save(struct snapshot *snapshot) {
+  const char *name;
+  void *value;
+  for (size_t cursor = 0; global.vars && strmap_next(global.vars, &cursor, &name, &value);) {
+    struct var *var = (struct var *) value;
+    snapshot_put_u32(snapshot, var->kind);
+    snapshot_put_string(snapshot, name);
+    if (var->kind == VAR_SCALAR) {
+      snapshot_put_string(snapshot, var->value ? var->value : "");
+    } else if (var->kind == VAR_INDEXED) {
+      /* Every index up to the length, with a flag for the gaps */
+      snapshot_put_u32(snapshot, var->length);
+      for (size_t i = 0; i < var->length; i++) {
+        snapshot_put_u32(snapshot, var->items[i] != NULL);
+        if (var->items[i] != NULL)
+          snapshot_put_string(snapshot, var->items[i]);
+      }
+    } else {
+      snapshot_put_u32(snapshot, strmap_length(var->map));
+      const char *key;
+      void *element;
+      for (size_t i = 0; strmap_next(var->map, &i, &key, &element);) {
+        snapshot_put_string(snapshot, key);
+        snapshot_put_string(snapshot, (const char *) element);
+      }
+    }
+  }
+}
+
+int vars_load(struct snapshot_reader *reader) {
+  uint32_t kind, length, present;
+  while (snapshot_get_u32(reader, &kind)) {
+    const char *name = snapshot_get_string(reader), *text, *key;
+    if (name == NULL || !is_name(name, strlen(name)) ||
+        (kind != VAR_SCALAR && kind != VAR_INDEXED && kind != VAR_ASSOC))
+      return -1;
+    struct var *var = var_new(name, kind);
+    if (kind == VAR_SCALAR) {
+      if ((text = snapshot_get_string(reader)) == NULL)
+        return -1;
+      var->value = strdup(text);
+      continue;
+    }
+    if (!snapshot_get_u32(reader, &length) || (kind == VAR_INDEXED && length > MAX_INDEX))
+      return -1;
+    if (kind == VAR_INDEXED) {
+      var->items = (char **) calloc(length, sizeof(char *));
+      var->length = var->capacity = length;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+      if (kind == VAR_INDEXED) {
+        if (!snapshot_get_u32(reader, &present))
+          return -1;
+        if (present && (text = snapshot_get_string(reader)) == NULL)
+          return -1;
+        var->items[i] = present ? strdup(text) : NULL;
+      } else {
+        if ((key = snapshot_get_string(reader)) == NULL ||
+            (text = snapshot_get_string(reader)) == NULL)
+          return -1;
+        /* A key given twice keeps its last value */
+        void **slot = strmap_put(var->map, key);
+        free(*slot);
+        *slot = strdup(text);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Prints a value in double quotes, so that it reads back as the same word */
+static void print_quoted(const char *value) {
+  putchar('"');
+  for (; *value != '\0'; value++) {
+    if (*value == '"' || *value == '\\' || *value == '$')
+      putchar('\\');
+    putchar(*value);
+  }
+  putchar('"');
+}
+
+struct printed {
+  struct var *var;
+  bool first;
+};
+
+static void print_element(const char *key, void *data) {
+  struct printed *printed = (struct printed *) data;
+  if (!printed->first)
+    putchar(' ');
+  printf("[%s]=", key);
+  print_quoted(var_element(printed->var, key, atoi(key)));
+  printed->first = false;
+}
+
+static int var_print(const char *name) {
+  struct var *var = var_find(name);
+  if (var == NULL) {
+    fprintf(stderr, "declare: %s: not found\n", name);
+    return 1;
+  }
+  if (var->kind == VAR_SCALAR) {
+    printf("declare -- %s=", name);
+    print_quoted(var->value ? var->value : "");
+  } else {
+    printf("declare -%c %s=(", var->kind == VAR_ASSOC ? 'A' : 'a', name);
+    struct printed printed = {var, true};
+    var_each(name, true, print_element, &printed);
+    putchar(')');
+  }
+  putchar('\n');
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+
+int cmd_declare(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens), i = 1;
+  char *option = tokens_get_token(tokens, 1);
+  enum var_kind kind = VAR_SCALAR;
+  bool print = length == 1;
+  if (option != NULL && strcmp(option, "-a") == 0)
+    kind = VAR_INDEXED, i++;
+  else if (option != NULL && strcmp(option, "-A") == 0)
+    kind = VAR_ASSOC, i++;
+  else if (option != NULL && strcmp(option, "-p") == 0)
+    print = true, i++;
+
+  if (print && i == length) {
+    /* Every visible name once, whichever scope it is in */
+    struct strmap *seen = strmap_new();
+    const char *key;
+    void *value;
+    for (struct scope *scope = top; scope != NULL; scope = scope->parent)
+      for (size_t cursor = 0; scope->vars && strmap_next(scope->vars, &cursor, &key, &value);)
+        strmap_put(seen, key);
+    size_t n = 0;
+    const char *names[strmap_length(seen) + 1];
+    for (size_t cursor = 0; strmap_next(seen, &cursor, &key, &value);)
+      if (var_find(key) != NULL)
+        names[n++] = key;
+    qsort(names, n, sizeof(char *), compare_names);
+    for (size_t j = 0; j < n; j++)
+      var_print(names[j]);
+    strmap_destroy(seen, NULL);
+    return 0;
+  }
+
+  int status = 0;
+  for (; i < length; i++) {
+    char *word = tokens_get_token(tokens, i);
+    if (print) {
+      status |= var_print(word);
+      continue;
+    }
+    char *equals = strchr(word, '=');
+    size_t name_length = equals ? (size_t) (equals - word) : strlen(word);
+    if (!is_name(word, name_length)) {
+      fprintf(stderr, "declare: `%s': not a valid identifier\n", word);
+      status = 1;
+      continue;
+    }
+    char *name = strndup(word, name_length);
+    if (vars_declare(name, kind) < 0 || (equals && vars_set(name, NULL, equals + 1) < 0))
+      status = 1;
+    free(name);
+  }
+  return status;
+}
+
+int cmd_unset(struct tokens *tokens) {
+  for (size_t i = 1; i < tokens_get_length(tokens); i++) {
+    char *word = tokens_get_token(tokens, i);
+    char *bracket = strchr(word, '[');
+    size_t length = strlen(word);
+    if (bracket != NULL && word[length - 1] == ']') {
+      char *name = strndup(word, bracket - word);
+      char *key = strndup(bracket + 1, word + length - bracket - 2);
+      vars_unset(name, key);
+      free(name);
+      free(key);
+    } else {
+      vars_unset(word, NULL);
+    }
+  }
+  return 0;
+}
+
+int cmd_export(struct tokens *tokens) {
+  size_t length = tokens_get_length(tokens);
+  if (length == 1) {
+    /* The whole environment, sorted by name */
+    size_t n = 0;
+    for (char **entry = environ; *entry != NULL; entry++)
+      n++;
+    const char *entries[n + 1];
+    memcpy(entries, environ, sizeof(char *) * n);
+    qsort(entries, n, sizeof(char *), compare_names);
+    for (size_t i = 0; i < n; i++) {
+      const char *equals = strchr(entries[i], '=');
+      if (equals == NULL)
+        continue;
+      printf("export %.*s=", (int) (equals - entries[i]), entries[i]);
+      print_quoted(equals + 1);
+      putchar('\n');
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for (size_t i = 1; i < length; i++) {
+    char *word = tokens_get_token(tokens, i);
+    char *equals = strchr(word, '=');
+    size_t name_length = equals ? (size_t) (equals - word) : strlen(word);
+    if (!is_name(word, name_length)) {
+      fprintf(stderr, "export: `%s': not a valid identifier\n", word);
+      status = 1;
+      continue;
+    }
+    char *name = strndup(word, name_length);
+    struct var *var = var_find(name);
+    if (var != NULL && var->kind != VAR_SCALAR) {
+      fprintf(stderr, "export: %s: arrays can't be exported\n", name);
+      status = 1;
+    } else if (equals != NULL) {
+      if (vars_set(name, NULL, equals + 1) < 0)
+        status = 1;
+      else
+        vars_setenv(name, equals + 1);
+    } else if (var != NULL && var->value != NULL) {
+      vars_setenv(name, var->value);
+    }
+    free(name);
+  }
+  return status;
+}
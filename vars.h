@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "parse.h"
+#include "snapshot.h"
+#include "tokenizer.h"
+
+/* Shell variables are scalars, indexed arrays (a dense vector of values) or associative arrays
+ * (a strmap). A name that isn't set falls back to the environment. */
+enum var_kind {
+  VAR_SCALAR,
+  VAR_INDEXED,
+  VAR_ASSOC,
+};
+
+/* Makes name a variable of the given kind (empty, if it is new); a scalar becomes element 0 of
+ * an array. Returns -1 if it is already a different kind of array. */
+int vars_declare(const char *name, enum var_kind kind);
+
+/* Gets the value of a variable, or of its element key (NULL means the scalar or element 0);
+ * NULL if it isn't set */
+const char *vars_get(const char *name, const char *key);
+
+/* Sets a variable, or its element key; returns -1 (after a message) if key isn't valid */
+int vars_set(const char *name, const char *key, const char *value);
+
+/* Removes a variable, or just its element key */
+void vars_unset(const char *name, const char *key);
+
+/* Sets an environment variable, or unsets it if value is NULL; the top scope puts back the old
+ * value when it is popped */
+void vars_setenv(const char *name, const char *value);
+
+/* Starts a new scope over the current one, in constant time: variables set or unset in it
+ * are gone once it is popped, and so are its changes to the environment */
+void vars_push_scope(void);
+
+/* Throws away the top scope */
+void vars_pop_scope(void);
+
+/* Sets what $? expands to */
+void vars_set_status(int status);
+
+/* Carries out an assignment; a plain NAME=VALUE also goes into the environment if export is
+ * set or the environment already has NAME. Returns -1 (after a message) if it can't be done. */
+int vars_assign(const struct assignment *assignment, bool export);
+
+/* Assigns text from outside the command line, such as a line read from a coprocess, to a plain
+ * variable as NAME=VALUE would, but without expanding anything in it */
+int vars_assign_text(const char *name, const char *value);
+
+/* Expands the $NAME, ${NAME}, ${NAME[KEY]}, ${#...} and $? references that tokenize() marked
+ * in a word; returns a new string */
+char *vars_expand(const char *word);
+
+/* Expands every word, a whole-word ${NAME[@]} (or ${!NAME[@]} for the keys) becoming one word
+ * per element. Returns NULL if there was nothing to expand. */
+struct tokens *vars_expand_words(struct tokens *words);
+
+/* Adds the shell's variables to a snapshot section */
+void vars_save(struct snapshot *snapshot);
+
+/* Loads the variables of a snapshot section, copying every value out of it; -1 if it is
+ * damaged */
+int vars_load(struct snapshot_reader *reader);
+
+/* Built-in: `declare [-a | -A] NAME[=VALUE]...' makes indexed (-a) or associative (-A) arrays;
+ * `declare [-p] [NAME...]' prints variables */
+int cmd_declare(struct tokens *tokens);
+
+/* Built-in: `unset NAME[KEY]...' removes variables or array elements */
+int cmd_unset(struct tokens *tokens);
+
+/* Built-in: `export NAME[=VALUE]...' puts variables in the environment of the commands the shell
+ * starts; `export' alone prints the environment */
+int cmd_export(struct tokens *tokens);